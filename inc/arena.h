@@ -0,0 +1,20 @@
+// Copyright (c) 2023, Marvin Borner <dev@marvinborner.de>
+// SPDX-License-Identifier: MIT
+
+#ifndef BLOC_ARENA_H
+#define BLOC_ARENA_H
+
+#include <stddef.h>
+
+// bump allocator, everything allocated in an arena is freed at once
+struct arena_block;
+struct arena {
+	struct arena_block *block; // current block, linked to the previous
+	size_t used; // of current block
+};
+
+void arena_init(struct arena *arena);
+void *arena_alloc(struct arena *arena, size_t size);
+void arena_destroy(struct arena *arena);
+
+#endif
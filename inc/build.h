@@ -8,9 +8,18 @@
 
 #include <spec.h>
 #include <tree.h>
+#include <optimize.h>
 #include <parse.h>
 
-void write_bloc(struct list *table, FILE *file);
-void write_blc(struct bloc_parsed *bloc, FILE *file);
+// 011
+#define REF_PREFIX_BITS 3
+
+int ref_bits(size_t ref);
+int varint_bits(size_t ref, int order);
+int ref_length(size_t ref, int flags);
+int shift_bits(size_t shift, int flags);
+void write_bloc(struct tree *tree, struct table *table, FILE *file, int flags);
+void write_blc(struct bloc_parsed *bloc, FILE *file, int packed);
+void write_term_blc(struct term *term, FILE *file, int packed);
 
 #endif
@@ -0,0 +1,30 @@
+// Copyright (c) 2023, Marvin Borner <dev@marvinborner.de>
+// SPDX-License-Identifier: MIT
+
+#ifndef BLOC_MAP_H
+#define BLOC_MAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <hash.h>
+
+// open-addressing hash map from hash_t to fixed-size values stored inline
+// inserting may move the values, so returned pointers are only valid until
+// the next insertion
+struct map {
+	size_t length;
+	size_t capacity; // power of two
+	size_t value_size;
+	hash_t *keys;
+	uint8_t *used;
+	uint8_t *values;
+};
+
+void map_init(struct map *map, size_t value_size, size_t expected);
+void map_destroy(struct map *map);
+void *map_insert(struct map *map, hash_t key, int *found);
+void *map_find(const struct map *map, hash_t key);
+void *map_next(const struct map *map, size_t *position, hash_t *key);
+
+#endif
@@ -4,8 +4,21 @@
 #ifndef BLOC_OPTIMIZE
 #define BLOC_OPTIMIZE
 
+#include <stddef.h>
+#include <stdint.h>
+
 #include <tree.h>
 
-struct list *optimize_tree(struct tree *tree, void **all_trees);
+// final table of the bloc file, entries are written in order and the
+// program itself is the last one
+struct table {
+	size_t length;
+	uint32_t *entries; // tree of every entry
+	uint32_t *index; // reference index of every entry tree
+	int order; // of the variable-width references, see build.c
+};
+
+struct table *optimize_tree(struct tree *tree);
+void free_table(struct table *table);
 
 #endif
@@ -5,17 +5,49 @@
 #define BLOC_PARSE_H
 
 #include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
 
 #include <term.h>
 #include <spec.h>
 
+// lazily parsed entries are decoded on first access via bloc_entry (or ahead
+// in parallel, if they are reachable and there are multiple threads) and
+// reference the original bloc data, which therefore has to outlive them
+// the terms of the entries are owned by the arenas
 struct bloc_parsed {
 	size_t length;
-	struct term **entries;
+	struct term **entries; // 0 if not yet decoded
+	const uint8_t *data; // first entry
+	size_t data_length;
+	uint64_t *offsets; // bit offset of each entry, only if lazy
+	struct arena *arenas; // one per decoding task
+	size_t arena_count;
+	int flags;
+	int order; // of variable-width references
 };
 
-struct term *parse_blc(const char *term);
-struct bloc_parsed *parse_bloc(const void *bloc);
+// streaming reader over blc, files are read in fixed-size chunks
+#define BLC_CHUNK_SIZE (64 << 10)
+struct blc_stream {
+	FILE *file; // 0 if reading from memory
+	const char *data;
+	size_t length;
+	size_t position;
+	int packed; // bit-packed instead of ascii
+	int bits; // remaining bits of byte
+	unsigned char byte;
+	char chunk[BLC_CHUNK_SIZE];
+};
+
+struct term *parse_blc(const char *term, size_t length, int packed);
+void free_blc(struct term *term);
+void blc_stream_file(struct blc_stream *stream, FILE *file, int packed);
+void blc_stream_buffer(struct blc_stream *stream, const char *data,
+		       size_t length, int packed);
+term_type blc_stream_next(struct blc_stream *stream, int *index);
+struct bloc_parsed *parse_bloc(const void *bloc, size_t length, int lazy);
+struct term *bloc_entry(struct bloc_parsed *bloc, size_t index);
 void free_bloc(struct bloc_parsed *bloc);
 
 #endif
@@ -0,0 +1,13 @@
+// Copyright (c) 2023, Marvin Borner <dev@marvinborner.de>
+// SPDX-License-Identifier: MIT
+
+#ifndef BLOC_POOL_H
+#define BLOC_POOL_H
+
+#include <stddef.h>
+
+typedef void (*pool_task_f)(size_t index, void *data);
+
+void pool_run(size_t count, pool_task_f task, void *data);
+
+#endif
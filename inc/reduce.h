@@ -0,0 +1,12 @@
+// Copyright (c) 2023, Marvin Borner <dev@marvinborner.de>
+// SPDX-License-Identifier: MIT
+
+#ifndef BLOC_REDUCE_H
+#define BLOC_REDUCE_H
+
+#include <arena.h>
+#include <term.h>
+
+void reduce_term(struct term *term, struct arena *arena);
+
+#endif
@@ -6,6 +6,7 @@
 
 #define BLOC_IDENTIFIER "BLoC"
 #define BLOC_IDENTIFIER_LENGTH 4
+#define BLOC_HEADER_LENGTH (BLOC_IDENTIFIER_LENGTH + 2)
 
 struct bloc_header {
 	char identifier[BLOC_IDENTIFIER_LENGTH];
@@ -13,6 +14,37 @@ struct bloc_header {
 	void *entries;
 } __attribute__((packed));
 
+// there's always at least one entry, so a v1 length of 0 marks the
+// extended header of version 2 and above
+#define BLOC_VERSION 2
+#define BLOC_HEADER_V2_LENGTH (BLOC_HEADER_LENGTH + 2)
+
+// the entries are preceded by 64-bit little-endian bit offsets of every
+// entry, relative to the first entry
+#define BLOC_FLAG_INDEX (1 << 0)
+
+// references may shift the free indices of their entry, see readme
+#define BLOC_FLAG_SHIFT (1 << 1)
+
+// references use a variable-width code instead of the fixed widths
+#define BLOC_FLAG_VARINT (1 << 2)
+
+// the entries form one contiguous bitstream instead of being padded to
+// full bytes
+#define BLOC_FLAG_UNPADDED (1 << 3)
+
+#define BLOC_FLAGS                                              \
+	(BLOC_FLAG_INDEX | BLOC_FLAG_SHIFT | BLOC_FLAG_VARINT | \
+	 BLOC_FLAG_UNPADDED)
+
+struct bloc_header_v2 {
+	char identifier[BLOC_IDENTIFIER_LENGTH];
+	short zero;
+	unsigned char version;
+	unsigned char flags;
+	void *length; // LEB128 varint, followed by the index and the entries
+} __attribute__((packed));
+
 struct bloc_entry {
 	void *expression;
 } __attribute__((packed));
@@ -6,6 +6,8 @@
 
 #include <stddef.h>
 
+#include <arena.h>
+
 typedef enum { INV, ABS, APP, VAR, REF } term_type;
 
 struct term {
@@ -23,12 +25,12 @@ struct term {
 		} var;
 		struct {
 			size_t index;
+			size_t shift; // of the entry's free indices
 		} ref;
 	} u;
 };
 
-struct term *new_term(term_type type);
-void free_term(struct term *term);
+struct term *new_term(struct arena *arena, term_type type);
 void diff_term(struct term *a, struct term *b);
 
 #endif
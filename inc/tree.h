@@ -4,48 +4,52 @@
 #ifndef BLOC_TREE_H
 #define BLOC_TREE_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 #include <term.h>
 #include <hash.h>
+#include <parse.h>
 
-#define VALIDATED_TREE ((hash_t)0x0)
-#define INVALIDATED_TREE ((hash_t)0xffffffff)
-#define FREEABLE_TREE(t)                                                       \
-	((t)->state != VALIDATED_TREE && (t)->state != INVALIDATED_TREE)
+#define TREE_NONE ((uint32_t)-1)
 
+// flat post-order representation of all trees, a tree is an index into the
+// columns and its subtrees always have smaller indices than itself
 struct tree {
-	term_type type;
-	hash_t hash;
-	hash_t state; // zero or index to ref
-	size_t size; // blc length
-	int duplication_count; // needed count to be considered for deduplication
-	union {
-		struct {
-			struct tree *term;
-		} abs;
-		struct {
-			struct tree *lhs;
-			struct tree *rhs;
-		} app;
-		struct {
-			int index;
-		} var;
-		struct {
-			hash_t hash;
-			size_t table_index;
-		} ref;
-	} u;
+	size_t length;
+	size_t capacity;
+	uint32_t root;
+	size_t shared; // amount of cloned table entries
+	uint8_t *type; // term_type
+	uint32_t *lhs; // ABS: term, APP: lhs, VAR: index
+	uint32_t *rhs; // APP: rhs
+	hash_t *hash;
+	uint32_t *size; // blc length
+	uint32_t *ref; // tree of the table entry replacing it or TREE_NONE
+	uint32_t *shift; // how far the free indices can be shifted down, only
+			 // if sharing shifted trees
 };
 
-struct list {
-	int val; // length or priority
-	void *data;
-	struct list *next;
+// callbacks of tree_walk, the subtrees (and post) are skipped if pre
+// returns 0, both may be 0
+typedef int (*tree_pre_f)(struct tree *tree, uint32_t i, void *data);
+typedef void (*tree_post_f)(struct tree *tree, uint32_t i, void *data);
+
+// explicit stack of tree_walk, consecutive walks reuse its memory
+struct walk_frame {
+	uint32_t tree;
+	int post; // subtrees are done
+};
+struct walk_stack {
+	struct walk_frame *frames;
+	size_t capacity;
 };
 
-struct list *list_add(struct list *list, void *data);
-struct tree *tree_merge_duplicates(struct term *term, void **all_trees);
-void tree_destroy(struct list *table);
+struct tree *tree_merge_duplicates(struct blc_stream *stream);
+void walk_stack_init(struct walk_stack *stack);
+void walk_stack_destroy(struct walk_stack *stack);
+void tree_walk(struct tree *tree, uint32_t root, tree_pre_f pre,
+	       tree_post_f post, void *data, struct walk_stack *stack);
+void tree_destroy(struct tree *tree);
 
 #endif
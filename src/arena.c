@@ -0,0 +1,55 @@
+// Copyright (c) 2023, Marvin Borner <dev@marvinborner.de>
+// SPDX-License-Identifier: MIT
+
+#include <stdlib.h>
+
+#include <arena.h>
+#include <log.h>
+
+#define ARENA_BLOCK_SIZE (64 << 10)
+#define ARENA_ALIGN sizeof(void *)
+
+struct arena_block {
+	struct arena_block *prev;
+	size_t size;
+	char data[];
+};
+
+void arena_init(struct arena *arena)
+{
+	arena->block = 0;
+	arena->used = 0;
+}
+
+// allocations larger than a block get a block of their own
+void *arena_alloc(struct arena *arena, size_t size)
+{
+	size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+	if (!arena->block || arena->used + size > arena->block->size) {
+		size_t block_size =
+			size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+		struct arena_block *block =
+			malloc(sizeof(*block) + block_size);
+		if (!block)
+			fatal("out of memory!\n");
+		block->prev = arena->block;
+		block->size = block_size;
+		arena->block = block;
+		arena->used = 0;
+	}
+
+	void *res = arena->block->data + arena->used;
+	arena->used += size;
+	return res;
+}
+
+void arena_destroy(struct arena *arena)
+{
+	struct arena_block *block = arena->block;
+	while (block) {
+		struct arena_block *prev = block->prev;
+		free(block);
+		block = prev;
+	}
+	arena_init(arena);
+}
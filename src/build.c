@@ -1,144 +1,1292 @@
 // Copyright (c) 2023, Marvin Borner <dev@marvinborner.de>
 // SPDX-License-Identifier: MIT
 
+#include <limits.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 
 #include <build.h>
 #include <log.h>
+#include <map.h>
+#include <pool.h>
 
-static void write_bit(char val, FILE *file, char *byte, int *bit)
+// the output is collected in a large buffer that's written at once
+#define WRITE_BUFFER_SIZE (1 << 20)
+
+// msb-first bit writer, the pending bits are kept in a 64-bit register and
+// only complete bytes are moved to the buffer
+struct bit_writer {
+	FILE *file; // 0 if everything stays in the buffer
+	uint8_t *buffer;
+	size_t length; // of the buffer
+	size_t capacity; // of the buffer, with two spare bytes
+	size_t flushed; // bytes written to the file
+	size_t keep; // bits from this position on stay in the buffer
+	uint64_t word; // pending bits in the lowest bits
+	int bits; // amount of pending bits
+};
+
+static void init_bits(struct bit_writer *writer, FILE *file)
+{
+	writer->file = file;
+	writer->capacity = WRITE_BUFFER_SIZE;
+	writer->buffer = malloc(writer->capacity + 2);
+	if (!writer->buffer)
+		fatal("out of memory!\n");
+	writer->length = 0;
+	writer->flushed = 0;
+	writer->keep = SIZE_MAX;
+	writer->word = 0;
+	writer->bits = 0;
+}
+
+// the buffer grows if too much of it has to be kept
+static void write_buffer(struct bit_writer *writer)
 {
-	if (*bit > 7) { // flush byte
-		fwrite(byte, 1, 1, file);
-		*byte = 0;
-		*bit = 0;
+	size_t length = writer->length;
+	if (writer->keep / 8 < writer->flushed + length)
+		length = writer->keep / 8 - writer->flushed;
+	if (writer->file && length) {
+		fwrite(writer->buffer, 1, length, writer->file);
+		memmove(writer->buffer, writer->buffer + length,
+			writer->length - length);
+		writer->length -= length;
+		writer->flushed += length;
 	}
 
-	if (val)
-		*byte |= 1UL << (7 - *bit);
-	(*bit)++;
+	if (writer->length > writer->capacity / 2) {
+		writer->capacity *= 2;
+		writer->buffer =
+			realloc(writer->buffer, writer->capacity + 2);
+		if (!writer->buffer)
+			fatal("out of memory!\n");
+	}
 }
 
-static void rec_write_bblc(struct tree *tree, FILE *file, char *byte, int *bit)
+static void write_byte(uint8_t byte, struct bit_writer *writer)
 {
-	switch (tree->type) {
-	case ABS:
-		write_bit(0, file, byte, bit);
-		write_bit(1, file, byte, bit);
-		write_bit(0, file, byte, bit);
-		rec_write_bblc(tree->u.abs.term, file, byte, bit);
-		break;
-	case APP:
-		write_bit(0, file, byte, bit);
-		write_bit(0, file, byte, bit);
-		rec_write_bblc(tree->u.app.lhs, file, byte, bit);
-		rec_write_bblc(tree->u.app.rhs, file, byte, bit);
-		break;
-	case VAR:
-		for (int i = 0; i <= tree->u.var.index; i++)
-			write_bit(1, file, byte, bit);
-		write_bit(0, file, byte, bit);
-		break;
-	case REF:
-		write_bit(0, file, byte, bit);
-		write_bit(1, file, byte, bit);
-		write_bit(1, file, byte, bit);
-
-		size_t ref = tree->u.ref.table_index;
-		int bits = 0;
-
-		// write index length bit prefixes
-		if (ref < 2 << 7) {
-			bits = 8;
-			write_bit(0, file, byte, bit);
-			write_bit(0, file, byte, bit);
-		} else if (ref < 2 << 15) {
-			bits = 16;
-			write_bit(0, file, byte, bit);
-			write_bit(1, file, byte, bit);
-		} else if (ref < 2l << 31) {
-			bits = 32;
-			write_bit(1, file, byte, bit);
-			write_bit(0, file, byte, bit);
+	if (writer->length == writer->capacity)
+		write_buffer(writer);
+	writer->buffer[writer->length++] = byte;
+}
+
+// moves the complete bytes of the register to the buffer
+static void flush_bits(struct bit_writer *writer)
+{
+	while (writer->bits >= 8) {
+		writer->bits -= 8;
+		write_byte(writer->word >> writer->bits, writer);
+	}
+}
+
+// appends the lowest count bits of value (which mustn't have higher bits)
+static void write_bits(uint64_t value, int count, struct bit_writer *writer)
+{
+	if (count > 32) {
+		write_bits(value >> 32, count - 32, writer);
+		value &= 0xffffffff;
+		count = 32;
+	}
+	if (writer->bits + count > 64)
+		flush_bits(writer);
+	writer->word = (writer->word << count) | value;
+	writer->bits += count;
+}
+
+// writes the unary run of ones terminated by a zero
+static void write_ones(size_t ones, struct bit_writer *writer)
+{
+	for (; ones >= 32; ones -= 32)
+		write_bits(0xffffffff, 32, writer);
+	write_bits((((uint64_t)1 << ones) - 1) << 1, ones + 1, writer);
+}
+
+// pads the pending bits with zeroes to a full byte
+static void align_bits(struct bit_writer *writer)
+{
+	flush_bits(writer);
+	if (writer->bits)
+		write_byte(writer->word << (8 - writer->bits), writer);
+	writer->word = 0;
+	writer->bits = 0;
+}
+
+// current position in bits
+static size_t tell_bits(struct bit_writer *writer)
+{
+	return (writer->flushed + writer->length) * 8 + writer->bits;
+}
+
+// copies the bits written since the position start, which must be kept
+static uint8_t *copy_bits(struct bit_writer *writer, size_t start)
+{
+	flush_bits(writer);
+	const size_t length = tell_bits(writer) - start;
+	uint8_t *bits = malloc(length / 8 + 1);
+	if (!bits)
+		fatal("out of memory!\n");
+
+	// the pending bits are padded into the spare bytes
+	writer->buffer[writer->length] = writer->word << (8 - writer->bits);
+	writer->buffer[writer->length + 1] = 0;
+
+	const size_t offset = start - writer->flushed * 8;
+	const uint8_t *from = writer->buffer + offset / 8;
+	const int shift = offset % 8;
+	for (size_t i = 0; i < (length + 7) / 8; i++)
+		bits[i] = from[i] << shift | from[i + 1] >> (8 - shift);
+	return bits;
+}
+
+// writes length bits that were copied with copy_bits
+static void paste_bits(const uint8_t *bits, size_t length,
+		       struct bit_writer *writer)
+{
+	for (; length >= 32; length -= 32, bits += 4)
+		write_bits((uint32_t)bits[0] << 24 | bits[1] << 16 |
+				   bits[2] << 8 | bits[3],
+			   32, writer);
+	for (; length >= 8; length -= 8)
+		write_bits(*bits++, 8, writer);
+	if (length)
+		write_bits(*bits >> (8 - length), length, writer);
+	flush_bits(writer); // ascii output bypasses the register
+}
+
+// bytes at both ends of a region that's filled concurrently may be shared
+// with the neighbouring regions, they are merged afterwards
+struct partials {
+	size_t length;
+	size_t index[2];
+	uint8_t byte[2];
+};
+
+// copies length bits to the bit position start of the output
+static void place_bits(uint8_t *output, size_t start, size_t length,
+		       const uint8_t *bits, struct partials *partials)
+{
+	const int shift = start % 8;
+	const size_t first = start / 8;
+	const size_t last = (start + length - 1) / 8;
+	const size_t bytes = (length + 7) / 8;
+	partials->length = 0;
+	for (size_t k = first; k <= last; k++) {
+		const size_t i = k - first;
+		uint8_t byte = i < bytes ? bits[i] >> shift : 0;
+		if (i && shift)
+			byte |= bits[i - 1] << (8 - shift);
+		if (k * 8 >= start && k * 8 + 8 <= start + length) {
+			output[k] = byte;
 		} else {
-			bits = 64; // i wanna see that program lol
-			write_bit(1, file, byte, bit);
-			write_bit(1, file, byte, bit);
+			partials->index[partials->length] = k;
+			partials->byte[partials->length++] = byte;
 		}
-		for (int i = 0; i < bits; i++)
-			write_bit((ref >> i) & 1, file, byte, bit);
-		break;
-	default:
-		fatal("invalid type %d\n", tree->type);
 	}
 }
 
-// writes bit-encoded blc into file
-static void write_bblc(struct tree *tree, FILE *file)
+static void merge_partials(uint8_t *output, struct partials *partials)
 {
-	char byte = 0;
-	int bit = 0;
-	rec_write_bblc(tree, file, &byte, &bit);
+	for (size_t i = 0; i < partials->length; i++)
+		output[partials->index[i]] |= partials->byte[i];
+}
 
-	if (bit) // flush final
-		fwrite(&byte, 1, 1, file);
+static void finish_bits(struct bit_writer *writer)
+{
+	align_bits(writer);
+	write_buffer(writer);
+	free(writer->buffer);
 }
 
-static void write_bloc_file(struct list *table, FILE *file)
+// reverses the lowest count bits of value
+static uint64_t reverse_bits(uint64_t value, int count)
 {
-	short length = table->val;
-	fwrite(BLOC_IDENTIFIER, BLOC_IDENTIFIER_LENGTH, 1, file);
-	fwrite(&length, 2, 1, file);
+	value = ((value >> 1) & 0x5555555555555555) |
+		((value & 0x5555555555555555) << 1);
+	value = ((value >> 2) & 0x3333333333333333) |
+		((value & 0x3333333333333333) << 2);
+	value = ((value >> 4) & 0x0f0f0f0f0f0f0f0f) |
+		((value & 0x0f0f0f0f0f0f0f0f) << 4);
+	return __builtin_bswap64(value) >> (64 - count);
+}
 
-	struct list *iterator = table;
-	while (iterator) {
-		write_bblc(iterator->data, file);
-		iterator = iterator->next;
-	}
+// length of the encoded reference index, see readme
+int ref_bits(size_t ref)
+{
+	if (ref < 2 << 7)
+		return 8;
+	if (ref < 2 << 15)
+		return 16;
+	if (ref < 2l << 31)
+		return 32;
+	return 64; // i wanna see that program lol
+}
+
+// position of the highest set bit
+static int log2_floor(uint64_t value)
+{
+	return 63 - __builtin_clzll(value);
 }
 
-void write_bloc(struct list *table, FILE *file)
+// variable-width references use exponential golomb codes: the elias gamma
+// code of (ref >> order) + 1, followed by the lowest order bits of ref
+int varint_bits(size_t ref, int order)
 {
-	short length = table->val;
-	debug("writing bloc with %ld elements\n", length);
+	return 2 * log2_floor((ref >> order) + 1) + 1 + order;
+}
 
-	write_bloc_file(table, file);
+// estimated length of an encoded reference without its shift, the order of
+// variable-width references is only known once the table is complete
+int ref_length(size_t ref, int flags)
+{
+	if (flags & BLOC_FLAG_VARINT)
+		return REF_PREFIX_BITS +
+		       varint_bits(ref, log2_floor(ref + 1) / 2);
+	return REF_PREFIX_BITS + 2 + ref_bits(ref);
 }
 
-static void fprint_bloc_blc(struct term *term, struct bloc_parsed *bloc,
-			    FILE *file)
+// additional length of a reference that shifts its entry, see readme
+int shift_bits(size_t shift, int flags)
 {
-	switch (term->type) {
+	if (!(flags & BLOC_FLAG_SHIFT))
+		return 0;
+	if (flags & BLOC_FLAG_VARINT) // always shifted
+		return shift + 1;
+	return shift ? shift + 3 : 0;
+}
+
+// state of the bit-encoded blc writer
+struct bblc_writer {
+	struct table *table;
+	int flags;
+	struct bit_writer *out;
+};
+
+static void write_bblc_bits(uint64_t value, int count,
+			    struct bblc_writer *writer)
+{
+	write_bits(value, count, writer->out);
+}
+
+static void write_bblc_ones(size_t ones, struct bblc_writer *writer)
+{
+	write_ones(ones, writer->out);
+}
+
+// the elias gamma code is the length of the binary representation in unary,
+// followed by the bits below its highest one (msb first)
+static void write_bblc_varint(size_t ref, size_t shift,
+			      struct bblc_writer *writer)
+{
+	const int order = writer->table->order;
+	const uint64_t value = ((uint64_t)ref >> order) + 1;
+	const int length = log2_floor(value);
+	write_bblc_ones(length, writer);
+	write_bblc_bits(value & ~((uint64_t)1 << length), length, writer);
+	write_bblc_bits(ref & (((uint64_t)1 << order) - 1), order, writer);
+	if (writer->flags & BLOC_FLAG_SHIFT)
+		write_bblc_ones(shift, writer);
+}
+
+// tree_walk callback, references and indices have no subtrees to write
+static int write_bblc_tree(struct tree *tree, uint32_t i, void *data)
+{
+	struct bblc_writer *writer = data;
+	if (tree->ref[i] != TREE_NONE) {
+		write_bblc_bits(3, REF_PREFIX_BITS, writer); // 011
+
+		size_t ref = writer->table->index[tree->ref[i]];
+		int bits = ref_bits(ref);
+		size_t shift = 0;
+		if (tree->shift)
+			shift = tree->shift[i] - tree->shift[tree->ref[i]];
+
+		if (writer->flags & BLOC_FLAG_VARINT) {
+			write_bblc_varint(ref, shift, writer);
+			return 0;
+		}
+
+		// shifted references use the prefix of 64-bit indices
+		int shifted = writer->flags & BLOC_FLAG_SHIFT &&
+			      (shift || bits == 64);
+		if (shifted)
+			write_bblc_bits(3, 2, writer);
+
+		// write index length bit prefixes, the index is lsb first
+		write_bblc_bits((bits >= 32) << 1 | (bits == 16 || bits == 64),
+				2, writer);
+		write_bblc_bits(reverse_bits(ref, bits), bits, writer);
+
+		if (shifted)
+			write_bblc_ones(shift, writer);
+		return 0;
+	}
+
+	switch (tree->type[i]) {
 	case ABS:
-		fprintf(file, "00");
-		fprint_bloc_blc(term->u.abs.term, bloc, file);
-		break;
+		write_bblc_bits(2, 3, writer); // 010
+		return 1;
 	case APP:
-		fprintf(file, "01");
-		fprint_bloc_blc(term->u.app.lhs, bloc, file);
-		fprint_bloc_blc(term->u.app.rhs, bloc, file);
-		break;
+		write_bblc_bits(0, 2, writer); // 00
+		return 1;
 	case VAR:
-		for (int i = 0; i <= term->u.var.index; i++)
-			fprintf(file, "1");
-		fprintf(file, "0");
-		break;
-	case REF:
-		if (term->u.ref.index + 1 >= bloc->length)
-			fatal("invalid ref index %ld\n", term->u.ref.index);
-		fprint_bloc_blc(
-			bloc->entries[bloc->length - term->u.ref.index - 2],
-			bloc, file);
-		break;
+		write_bblc_ones(tree->lhs[i] + 1, writer);
+		return 0;
 	default:
-		fatal("invalid type %d\n", term->type);
+		fatal("invalid type %d\n", tree->type[i]);
+		return 0;
+	}
+}
+
+static void write_varint(size_t value, FILE *file)
+{
+	do {
+		unsigned char byte = value & 0x7f;
+		value >>= 7;
+		if (value)
+			byte |= 0x80;
+		fputc(byte, file);
+	} while (value);
+}
+
+static void write_u64(uint64_t value, FILE *file)
+{
+	for (int i = 0; i < 8; i++)
+		fputc((value >> (i * 8)) & 0xff, file);
+}
+
+// amount of threads
+extern size_t threads;
+
+// amount of entries encoded by a task
+#define ENCODE_TASK_ENTRIES (1 << 10)
+
+// consecutive entries are encoded by the same task
+struct encode_task {
+	size_t first; // entry
+	size_t count;
+	size_t offset; // position of the first entry in bits
+	size_t length;
+	uint8_t *bits; // encoded entries
+	struct partials partials;
+};
+
+struct parallel_encoding {
+	struct tree *tree;
+	struct table *table;
+	int flags;
+	size_t *lengths; // of every entry in bits, including its padding
+	struct encode_task *tasks;
+	size_t count; // of tasks
+	uint8_t *output;
+};
+
+// the lengths of the entries are stored if lengths isn't 0
+static void write_entries(struct parallel_encoding *encoding, size_t first,
+			  size_t count, struct bit_writer *out)
+{
+	struct bblc_writer writer = {
+		.table = encoding->table,
+		.flags = encoding->flags,
+		.out = out,
+	};
+	struct walk_stack stack;
+	walk_stack_init(&stack);
+	for (size_t i = first; i < first + count; i++) {
+		const size_t start = tell_bits(out);
+		tree_walk(encoding->tree, encoding->table->entries[i],
+			  write_bblc_tree, 0, &writer, &stack);
+		if (!(encoding->flags & BLOC_FLAG_UNPADDED))
+			align_bits(out);
+		if (encoding->lengths)
+			encoding->lengths[i] = tell_bits(out) - start;
+	}
+	walk_stack_destroy(&stack);
+}
+
+// every task encodes its entries into a buffer of its own
+static void encode_task(size_t index, void *data)
+{
+	struct parallel_encoding *encoding = data;
+	struct encode_task *task = &encoding->tasks[index];
+	struct bit_writer out;
+	init_bits(&out, 0);
+	write_entries(encoding, task->first, task->count, &out);
+	task->length = tell_bits(&out);
+	align_bits(&out);
+
+	// the buffer is kept until it's copied, its spare capacity isn't
+	task->bits = realloc(out.buffer, out.length ? out.length : 1);
+	if (!task->bits)
+		fatal("out of memory!\n");
+}
+
+static void place_task(size_t index, void *data)
+{
+	struct parallel_encoding *encoding = data;
+	struct encode_task *task = &encoding->tasks[index];
+	place_bits(encoding->output, task->offset, task->length, task->bits,
+		   &task->partials);
+	free(task->bits);
+}
+
+// the entries are encoded in parallel, each one is walked only once
+static void encode_entries(struct parallel_encoding *encoding)
+{
+	const size_t length = encoding->table->length;
+	const size_t count =
+		(length + ENCODE_TASK_ENTRIES - 1) / ENCODE_TASK_ENTRIES;
+	encoding->tasks = malloc(count * sizeof(*encoding->tasks));
+	if (!encoding->tasks)
+		fatal("out of memory!\n");
+	encoding->count = count;
+	for (size_t i = 0; i < count; i++) {
+		const size_t first = i * ENCODE_TASK_ENTRIES;
+		encoding->tasks[i] = (struct encode_task){
+			.first = first,
+			.count = length - first < ENCODE_TASK_ENTRIES ?
+					 length - first :
+					 ENCODE_TASK_ENTRIES,
+		};
+	}
+	pool_run(count, encode_task, encoding);
+}
+
+// the offsets of the encoded buffers are the prefix sum of their lengths,
+// they're copied to their position in the output in parallel as well
+static void write_encoded_entries(struct parallel_encoding *encoding,
+				  FILE *file)
+{
+	const size_t count = encoding->count;
+	size_t total = 0;
+	for (size_t i = 0; i < count; i++) {
+		encoding->tasks[i].offset = total;
+		total += encoding->tasks[i].length;
+	}
+	debug("encoded %lu bits in %lu tasks\n", total, count);
+
+	const size_t size = (total + 7) / 8;
+	encoding->output = calloc(size, 1);
+	if (!encoding->output)
+		fatal("out of memory!\n");
+	pool_run(count, place_task, encoding);
+
+	for (size_t i = 0; i < count; i++)
+		merge_partials(encoding->output, &encoding->tasks[i].partials);
+	fwrite(encoding->output, 1, size, file);
+
+	free(encoding->output);
+	free(encoding->tasks);
+}
+
+static void write_bloc_file(struct tree *tree, struct table *table,
+			    FILE *file, int flags)
+{
+	fwrite(BLOC_IDENTIFIER, BLOC_IDENTIFIER_LENGTH, 1, file);
+
+	// the v1 header can't store more entries
+	if (!flags && table->length <= SHRT_MAX) {
+		short length = table->length;
+		fwrite(&length, 2, 1, file);
+	} else {
+		short zero = 0;
+		fwrite(&zero, 2, 1, file);
+		fputc(BLOC_VERSION, file);
+		fputc(flags, file);
+		if (flags & BLOC_FLAG_VARINT)
+			fputc(table->order, file);
+		write_varint(table->length, file);
+	}
+
+	struct parallel_encoding encoding = {
+		.tree = tree,
+		.table = table,
+		.flags = flags,
+		.lengths = 0,
+	};
+
+	// the entries are encoded into buffers first if the index needs their
+	// lengths or if there are multiple threads
+	const int parallel =
+		threads > 1 && table->length > ENCODE_TASK_ENTRIES;
+	if (flags & BLOC_FLAG_INDEX) {
+		encoding.lengths =
+			malloc(table->length * sizeof(*encoding.lengths));
+		if (!encoding.lengths)
+			fatal("out of memory!\n");
+	}
+	if (flags & BLOC_FLAG_INDEX || parallel)
+		encode_entries(&encoding);
+
+	if (flags & BLOC_FLAG_INDEX) {
+		uint64_t offset = 0;
+		for (size_t i = 0; i < table->length; i++) {
+			write_u64(offset, file);
+			offset += encoding.lengths[i];
+		}
+	}
+
+	if (flags & BLOC_FLAG_INDEX || parallel) {
+		write_encoded_entries(&encoding, file);
+	} else {
+		struct bit_writer out;
+		init_bits(&out, file);
+		write_entries(&encoding, 0, table->length, &out);
+		finish_bits(&out);
+	}
+	free(encoding.lengths);
+}
+
+void write_bloc(struct tree *tree, struct table *table, FILE *file, int flags)
+{
+	debug("writing bloc with %lu elements\n", table->length);
+
+	write_bloc_file(tree, table, file, flags);
+}
+
+// blc output, either ascii or bit-packed
+struct blc_writer {
+	struct bit_writer out;
+	int packed;
+};
+
+static void write_blc_bits(uint64_t value, int count,
+			   struct blc_writer *writer)
+{
+	if (writer->packed) {
+		write_bits(value, count, &writer->out);
+		return;
+	}
+	while (count--)
+		write_byte((value >> count) & 1 ? '1' : '0', &writer->out);
+}
+
+static void write_blc_ones(size_t ones, struct blc_writer *writer)
+{
+	if (writer->packed) {
+		write_ones(ones, &writer->out);
+		return;
+	}
+	while (ones--)
+		write_byte('1', &writer->out);
+	write_byte('0', &writer->out);
+}
+
+// term on the expansion stack, a term of 0 ends a shifted reference or the
+// recording of an entry
+struct expand_frame {
+	struct term *term;
+	size_t depth; // binders above the term
+	char end; // EXPAND_END_*
+};
+
+#define EXPAND_END_CONTEXT 1
+#define EXPAND_END_RECORDING 2
+
+// entry of a shifted reference, its free indices are those that point
+// above the binders of the reference
+struct shift_context {
+	size_t depth;
+	size_t shift;
+};
+
+// applies the shifts of all enclosing references to an index, an index
+// that's bound inside an entry is bound in the enclosing ones as well
+static size_t shift_index(struct shift_context *contexts, size_t length,
+			  size_t depth, size_t index)
+{
+	while (length--) {
+		if (index < depth - contexts[length].depth)
+			break;
+		index += contexts[length].shift;
+	}
+	return index;
+}
+
+// the expansion of every entry is recorded the first time it's written, so
+// later references only copy its bits -- the cached bits of an entry with
+// free indices depend on the enclosing shifts though, so they're only
+// used outside of shifted references
+#define EXPAND_CACHE_SIZE (1 << 26) // bytes
+
+struct expand_cache {
+	uint8_t *bits; // 0 if not cached (yet)
+	size_t length; // in bits
+	size_t escape; // highest free index + 1, 0 if there are none
+	int failed; // too large to be cached
+};
+
+// an entry that's being written
+struct recording {
+	size_t entry;
+	size_t start; // position in bits
+	size_t depth; // of its reference
+	size_t escape; // see expand_cache
+	int live; // not yet dropped due to its size
+};
+
+struct expander {
+	struct bloc_parsed *bloc;
+	struct blc_writer *writer;
+	struct expand_frame *stack;
+	size_t capacity;
+	struct shift_context *contexts;
+	size_t contexts_length;
+	size_t contexts_capacity;
+	struct expand_cache *cache;
+	size_t cached; // total bytes
+	size_t budget; // maximum of cached
+	struct recording *recordings;
+	size_t recordings_length;
+	size_t recordings_capacity;
+	size_t live; // index of the oldest live recording
+};
+
+static void init_expander(struct expander *expander, struct bloc_parsed *bloc,
+			  struct blc_writer *writer, size_t budget)
+{
+	expander->bloc = bloc;
+	expander->writer = writer;
+	expander->capacity = 64;
+	expander->stack = malloc(expander->capacity * sizeof(*expander->stack));
+	expander->contexts_length = 0;
+	expander->contexts_capacity = 16;
+	expander->contexts = malloc(expander->contexts_capacity *
+				    sizeof(*expander->contexts));
+	expander->cache = 0;
+	if (bloc)
+		expander->cache =
+			calloc(bloc->length, sizeof(*expander->cache));
+	expander->cached = 0;
+	expander->budget = budget;
+	expander->recordings_length = 0;
+	expander->recordings_capacity = 16;
+	expander->recordings = malloc(expander->recordings_capacity *
+				      sizeof(*expander->recordings));
+	expander->live = 0;
+	if (!expander->stack || !expander->contexts || !expander->recordings ||
+	    (bloc && !expander->cache))
+		fatal("out of memory!\n");
+}
+
+static void destroy_expander(struct expander *expander)
+{
+	if (expander->bloc)
+		for (size_t i = 0; i < expander->bloc->length; i++)
+			free(expander->cache[i].bits);
+	free(expander->cache);
+	free(expander->recordings);
+	free(expander->contexts);
+	free(expander->stack);
+}
+
+// the oldest recording pins the buffer, it's dropped if it can't be cached
+// anymore (the newer ones are smaller)
+static void pin_recordings(struct expander *expander)
+{
+	struct bit_writer *out = &expander->writer->out;
+	const size_t position = tell_bits(out);
+	while (expander->live < expander->recordings_length) {
+		struct recording *recording =
+			&expander->recordings[expander->live];
+		if ((position - recording->start) / 8 <
+		    expander->budget - expander->cached)
+			break;
+		recording->live = 0;
+		expander->cache[recording->entry].failed = 1;
+		expander->live++;
+	}
+	out->keep = expander->live < expander->recordings_length ?
+			    expander->recordings[expander->live].start :
+			    SIZE_MAX;
+}
+
+static void start_recording(struct expander *expander, size_t entry,
+			    size_t depth)
+{
+	if (expander->recordings_length == expander->recordings_capacity) {
+		expander->recordings_capacity *= 2;
+		expander->recordings =
+			realloc(expander->recordings,
+				expander->recordings_capacity *
+					sizeof(*expander->recordings));
+		if (!expander->recordings)
+			fatal("out of memory!\n");
+	}
+	expander->recordings[expander->recordings_length++] =
+		(struct recording){
+			.entry = entry,
+			.start = tell_bits(&expander->writer->out),
+			.depth = depth,
+			.escape = 0,
+			.live = 1,
+		};
+	pin_recordings(expander);
+}
+
+// entries with free indices are only cached outside of shifted references
+static void end_recording(struct expander *expander)
+{
+	struct recording *recording =
+		&expander->recordings[--expander->recordings_length];
+	struct bit_writer *out = &expander->writer->out;
+	struct expand_cache *cache = &expander->cache[recording->entry];
+	if (expander->live > expander->recordings_length)
+		expander->live = expander->recordings_length;
+
+	const int standalone = !expander->contexts_length;
+	if (recording->live && (!recording->escape || standalone)) {
+		cache->length = tell_bits(out) - recording->start;
+		if (cache->length / 8 + 1 <=
+		    expander->budget - expander->cached) {
+			cache->bits = copy_bits(out, recording->start);
+			cache->escape = recording->escape;
+			expander->cached += cache->length / 8 + 1;
+		} else {
+			cache->failed = 1;
+		}
+	}
+	pin_recordings(expander);
+}
+
+// updates the escape of all recorded entries in which the index is free
+static void free_index(struct expander *expander, size_t depth, size_t index)
+{
+	for (size_t i = expander->recordings_length; i-- > 0;) {
+		struct recording *recording = &expander->recordings[i];
+		const size_t bound = depth - recording->depth;
+		if (index < bound)
+			break;
+		if (index - bound + 1 > recording->escape)
+			recording->escape = index - bound + 1;
 	}
 }
 
-void write_blc(struct bloc_parsed *bloc, FILE *file)
+static void push_context(struct expander *expander, size_t depth,
+			 size_t shift)
+{
+	if (expander->contexts_length == expander->contexts_capacity) {
+		expander->contexts_capacity *= 2;
+		expander->contexts =
+			realloc(expander->contexts,
+				expander->contexts_capacity *
+					sizeof(*expander->contexts));
+		if (!expander->contexts)
+			fatal("out of memory!\n");
+	}
+	expander->contexts[expander->contexts_length++] =
+		(struct shift_context){ depth, shift };
+}
+
+// expands the references while writing, with an explicit stack of terms
+static void expand_term(struct expander *expander, struct term *term)
+{
+	struct bloc_parsed *bloc = expander->bloc;
+	struct blc_writer *writer = expander->writer;
+	struct expand_frame *stack = expander->stack;
+	size_t depth = 0;
+
+	stack[depth++] = (struct expand_frame){ term, 0, 0 };
+	while (depth) {
+		const struct expand_frame frame = stack[--depth];
+		term = frame.term;
+		if (depth + 3 > expander->capacity) {
+			expander->capacity *= 2;
+			stack = realloc(stack,
+					expander->capacity * sizeof(*stack));
+			if (!stack)
+				fatal("out of memory!\n");
+			expander->stack = stack;
+		}
+
+		if (frame.end == EXPAND_END_CONTEXT) {
+			expander->contexts_length--;
+			continue;
+		}
+		if (frame.end == EXPAND_END_RECORDING) {
+			end_recording(expander);
+			continue;
+		}
+
+		switch (term->type) {
+		case ABS:
+			write_blc_bits(0, 2, writer); // 00
+			stack[depth++] = (struct expand_frame){
+				term->u.abs.term, frame.depth + 1, 0
+			};
+			break;
+		case APP:
+			write_blc_bits(1, 2, writer); // 01
+			stack[depth++] = (struct expand_frame){
+				term->u.app.rhs, frame.depth, 0
+			};
+			stack[depth++] = (struct expand_frame){
+				term->u.app.lhs, frame.depth, 0
+			};
+			break;
+		case VAR:;
+			const size_t index = shift_index(
+				expander->contexts, expander->contexts_length,
+				frame.depth, term->u.var.index);
+			free_index(expander, frame.depth, index);
+			write_blc_ones(index + 1, writer);
+			break;
+		case REF:
+			if (term->u.ref.index + 1 >= bloc->length)
+				fatal("invalid ref index %ld\n",
+				      term->u.ref.index);
+			const size_t entry =
+				bloc->length - term->u.ref.index - 2;
+			const int standalone = !expander->contexts_length &&
+					       !term->u.ref.shift;
+			struct expand_cache *cache = &expander->cache[entry];
+			if (cache->bits && (!cache->escape || standalone)) {
+				if (cache->escape)
+					free_index(expander, frame.depth,
+						   cache->escape - 1);
+				paste_bits(cache->bits, cache->length,
+					   &writer->out);
+				break;
+			}
+
+			if (term->u.ref.shift) {
+				push_context(expander, frame.depth,
+					     term->u.ref.shift);
+				stack[depth++] = (struct expand_frame){
+					0, frame.depth, EXPAND_END_CONTEXT
+				};
+			}
+			if (!cache->bits && !cache->failed) {
+				start_recording(expander, entry, frame.depth);
+				stack[depth++] = (struct expand_frame){
+					0, frame.depth, EXPAND_END_RECORDING
+				};
+			}
+			stack[depth++] = (struct expand_frame){
+				bloc_entry(bloc, entry), frame.depth, 0
+			};
+			break;
+		default:
+			fatal("invalid type %d\n", term->type);
+		}
+	}
+}
+
+// the expanded lengths of the entries (in output bits, or characters of
+// ascii output) are computed in post-order with explicit stacks
+struct lengths {
+	size_t *entries; // SIZE_MAX if not yet known
+	struct term **terms;
+	size_t terms_capacity;
+	size_t *pending; // entries
+	size_t pending_length;
+	size_t pending_capacity;
+	struct map subterms; // lengths of split subterms, by address
+};
+
+static size_t add_length(size_t a, size_t b)
+{
+	if (a > SIZE_MAX - 1 - b)
+		fatal("expansion too large!\n");
+	return a + b;
+}
+
+// unknown entries are pushed to the pending ones and complete is cleared
+static size_t term_length(struct lengths *lengths, struct bloc_parsed *bloc,
+			  struct term *term, int *complete)
+{
+	size_t length = 0, depth = 0;
+	struct term **stack = lengths->terms;
+	stack[depth++] = term;
+	while (depth) {
+		term = stack[--depth];
+		if (depth + 2 > lengths->terms_capacity) {
+			lengths->terms_capacity *= 2;
+			stack = realloc(stack, lengths->terms_capacity *
+						       sizeof(*stack));
+			if (!stack)
+				fatal("out of memory!\n");
+			lengths->terms = stack;
+		}
+
+		switch (term->type) {
+		case ABS:
+			length = add_length(length, 2);
+			stack[depth++] = term->u.abs.term;
+			break;
+		case APP:
+			length = add_length(length, 2);
+			stack[depth++] = term->u.app.rhs;
+			stack[depth++] = term->u.app.lhs;
+			break;
+		case VAR:
+			length = add_length(length, term->u.var.index + 2);
+			break;
+		case REF:
+			if (term->u.ref.index + 1 >= bloc->length)
+				fatal("invalid ref index %ld\n",
+				      term->u.ref.index);
+			const size_t entry =
+				bloc->length - term->u.ref.index - 2;
+			if (lengths->entries[entry] != SIZE_MAX) {
+				length = add_length(length,
+						    lengths->entries[entry]);
+				break;
+			}
+			*complete = 0;
+			if (lengths->pending_length ==
+			    lengths->pending_capacity) {
+				lengths->pending_capacity *= 2;
+				lengths->pending = realloc(
+					lengths->pending,
+					lengths->pending_capacity *
+						sizeof(*lengths->pending));
+				if (!lengths->pending)
+					fatal("out of memory!\n");
+			}
+			lengths->pending[lengths->pending_length++] = entry;
+			break;
+		default:
+			fatal("invalid type %d\n", term->type);
+		}
+	}
+	return length;
+}
+
+// also decodes all entries reachable from the final one
+static void init_lengths(struct lengths *lengths, struct bloc_parsed *bloc)
+{
+	lengths->entries = malloc(bloc->length * sizeof(*lengths->entries));
+	lengths->terms_capacity = 64;
+	lengths->terms =
+		malloc(lengths->terms_capacity * sizeof(*lengths->terms));
+	lengths->pending_capacity = 64;
+	lengths->pending =
+		malloc(lengths->pending_capacity * sizeof(*lengths->pending));
+	if (!lengths->entries || !lengths->terms || !lengths->pending)
+		fatal("out of memory!\n");
+	for (size_t i = 0; i < bloc->length; i++)
+		lengths->entries[i] = SIZE_MAX;
+	map_init(&lengths->subterms, sizeof(size_t), 0);
+
+	// an entry is computed once all of its references are known
+	lengths->pending[0] = bloc->length - 1;
+	lengths->pending_length = 1;
+	while (lengths->pending_length) {
+		const size_t entry =
+			lengths->pending[lengths->pending_length - 1];
+		if (lengths->entries[entry] != SIZE_MAX) {
+			lengths->pending_length--;
+			continue;
+		}
+		int complete = 1;
+		const size_t length = term_length(
+			lengths, bloc, bloc_entry(bloc, entry), &complete);
+		if (complete) {
+			lengths->entries[entry] = length;
+			lengths->pending_length--;
+		}
+	}
+}
+
+static hash_t hash_subterm(struct term *term)
+{
+	return hash((const uint8_t *)&term, sizeof(term), 0);
+}
+
+// the lengths of all subterms are stored at once, as the subterms of long
+// application spines would otherwise be walked again and again
+static size_t subterm_length(struct lengths *lengths,
+			     struct bloc_parsed *bloc, struct term *term)
+{
+	size_t *known = map_find(&lengths->subterms, hash_subterm(term));
+	if (known)
+		return *known;
+
+	size_t depth = 0, capacity = 64;
+	struct term **stack = malloc(capacity * sizeof(*stack));
+	size_t values = 0; // lengths of complete subterms
+	size_t *results = malloc(capacity * sizeof(*results));
+	if (!stack || !results)
+		fatal("out of memory!\n");
+
+	// terms are pushed twice, tagged with the lowest bit after the first
+	stack[depth++] = term;
+	while (depth) {
+		struct term *frame = stack[--depth];
+		const int post = (uintptr_t)frame & 1;
+		term = (struct term *)((uintptr_t)frame & ~(uintptr_t)1);
+		if (depth + 3 > capacity) {
+			capacity *= 2;
+			stack = realloc(stack, capacity * sizeof(*stack));
+			results = realloc(results, capacity * sizeof(*results));
+			if (!stack || !results)
+				fatal("out of memory!\n");
+		}
+
+		if (!post && (term->type == ABS || term->type == APP)) {
+			stack[depth++] = (struct term *)((uintptr_t)term | 1);
+			if (term->type == ABS) {
+				stack[depth++] = term->u.abs.term;
+			} else {
+				stack[depth++] = term->u.app.rhs;
+				stack[depth++] = term->u.app.lhs;
+			}
+			continue;
+		}
+
+		// all reachable entries are known, so leaves are complete
+		int complete = 1;
+		if (!post) {
+			results[values++] =
+				term_length(lengths, bloc, term, &complete);
+			continue;
+		}
+
+		size_t length = add_length(2, results[--values]);
+		if (term->type == APP)
+			length = add_length(length, results[--values]);
+		results[values++] = length;
+
+		int found;
+		size_t *value = map_insert(&lengths->subterms,
+					   hash_subterm(term), &found);
+		*value = length;
+	}
+
+	const size_t length = results[0];
+	free(stack);
+	free(results);
+	return length;
+}
+
+static void destroy_lengths(struct lengths *lengths)
+{
+	map_destroy(&lengths->subterms);
+	free(lengths->entries);
+	free(lengths->terms);
+	free(lengths->pending);
+}
+
+// the final term is split into pieces (subterms or the opcodes above them)
+// with known lengths, consecutive pieces are expanded by the same task
+struct piece {
+	struct term *term; // 0 for an opcode
+	int opcode;
+	size_t length;
+};
+
+struct expand_task {
+	size_t first; // piece
+	size_t count;
+	size_t offset; // position of the first piece
+	size_t length;
+	struct partials partials;
+};
+
+struct parallel_expansion {
+	struct bloc_parsed *bloc;
+	int packed;
+	struct piece *pieces;
+	struct expand_task *tasks;
+	uint8_t *output;
+};
+
+// the minimum length of a task (in output bits or characters)
+#define EXPAND_TASK_LENGTH (1 << 16)
+
+// parallel expansion needs a buffer of the whole output
+#define EXPAND_PARALLEL_MAX ((size_t)1 << 32)
+
+static struct piece *split_pieces(struct lengths *lengths,
+				  struct bloc_parsed *bloc, size_t target,
+				  size_t *count)
+{
+	size_t length = 0, capacity = 64;
+	struct piece *pieces = malloc(capacity * sizeof(*pieces));
+	size_t depth = 0, stack_capacity = 64;
+	struct piece *stack = malloc(stack_capacity * sizeof(*stack));
+	if (!pieces || !stack)
+		fatal("out of memory!\n");
+
+	const size_t final = bloc->length - 1;
+	stack[depth++] = (struct piece){ bloc_entry(bloc, final), 0,
+					 lengths->entries[final] };
+	while (depth) {
+		const struct piece piece = stack[--depth];
+		struct term *term = piece.term;
+		if (depth + 3 > stack_capacity) {
+			stack_capacity *= 2;
+			stack = realloc(stack, stack_capacity * sizeof(*stack));
+			if (!stack)
+				fatal("out of memory!\n");
+		}
+
+		if (!term || piece.length <= target || term->type == VAR) {
+			if (length == capacity) {
+				capacity *= 2;
+				pieces = realloc(pieces,
+						 capacity * sizeof(*pieces));
+				if (!pieces)
+					fatal("out of memory!\n");
+			}
+			pieces[length++] = piece;
+			continue;
+		}
+
+		switch (term->type) {
+		case ABS:
+			stack[depth++] = (struct piece){ term->u.abs.term, 0,
+							 piece.length - 2 };
+			stack[depth++] = (struct piece){ 0, 0, 2 };
+			break;
+		case APP:;
+			const size_t lhs =
+				subterm_length(lengths, bloc, term->u.app.lhs);
+			stack[depth++] = (struct piece){
+				term->u.app.rhs, 0, piece.length - 2 - lhs
+			};
+			stack[depth++] =
+				(struct piece){ term->u.app.lhs, 0, lhs };
+			stack[depth++] = (struct piece){ 0, 1, 2 };
+			break;
+		case REF:;
+			const size_t entry =
+				bloc->length - term->u.ref.index - 2;
+			stack[depth++] = (struct piece){
+				bloc_entry(bloc, entry), 0, piece.length
+			};
+			break;
+		default:
+			fatal("invalid type %d\n", term->type);
+		}
+	}
+
+	free(stack);
+	*count = length;
+	return pieces;
+}
+
+static void expand_task(size_t index, void *data)
+{
+	struct parallel_expansion *expansion = data;
+	struct expand_task *task = &expansion->tasks[index];
+	struct blc_writer writer = { .packed = expansion->packed };
+	init_bits(&writer.out, 0);
+
+	struct expander expander;
+	init_expander(&expander, expansion->bloc, &writer,
+		      EXPAND_CACHE_SIZE / threads);
+	for (size_t i = task->first; i < task->first + task->count; i++) {
+		struct piece *piece = &expansion->pieces[i];
+		if (piece->term)
+			expand_term(&expander, piece->term);
+		else
+			write_blc_bits(piece->opcode, 2, &writer);
+	}
+	destroy_expander(&expander);
+	align_bits(&writer.out);
+
+	const int scale = expansion->packed ? 1 : 8;
+	place_bits(expansion->output, task->offset * scale,
+		   task->length * scale, writer.out.buffer, &task->partials);
+	free(writer.out.buffer);
+}
+
+// the subterms of the final term are expanded in parallel directly into
+// their precomputed position in the output, returns 0 if that's not
+// possible or worth it
+static int write_parallel(struct bloc_parsed *bloc, FILE *file, int packed)
+{
+	// expansions of shifted references depend on their context
+	if (threads <= 1 || bloc->flags & BLOC_FLAG_SHIFT)
+		return 0;
+
+	struct lengths lengths;
+	init_lengths(&lengths, bloc);
+	const size_t total = lengths.entries[bloc->length - 1];
+	const size_t size = packed ? (total + 7) / 8 : total + 1;
+	if (total < 2 * EXPAND_TASK_LENGTH || size > EXPAND_PARALLEL_MAX) {
+		destroy_lengths(&lengths);
+		return 0;
+	}
+
+	size_t target = total / (threads * 8);
+	if (target < EXPAND_TASK_LENGTH)
+		target = EXPAND_TASK_LENGTH;
+	size_t count;
+	struct piece *pieces = split_pieces(&lengths, bloc, target, &count);
+	destroy_lengths(&lengths);
+
+	// consecutive pieces are grouped until they reach the target length
+	struct expand_task *tasks = malloc(count * sizeof(*tasks));
+	if (!tasks)
+		fatal("out of memory!\n");
+	size_t length = 0, offset = 0;
+	for (size_t i = 0; i < count; i++) {
+		struct expand_task *task = &tasks[length];
+		if (!i || task[-1].length >= target) {
+			*task = (struct expand_task){ .first = i,
+						      .offset = offset };
+			length++;
+		} else {
+			task--;
+		}
+		task->count++;
+		task->length += pieces[i].length;
+		offset += pieces[i].length;
+	}
+	debug("expanding %lu bits in %lu tasks\n", total, length);
+
+	struct parallel_expansion expansion = {
+		.bloc = bloc,
+		.packed = packed,
+		.pieces = pieces,
+		.tasks = tasks,
+		.output = calloc(size, 1),
+	};
+	if (!expansion.output)
+		fatal("out of memory!\n");
+	pool_run(length, expand_task, &expansion);
+
+	for (size_t i = 0; i < length; i++)
+		merge_partials(expansion.output, &tasks[i].partials);
+	if (!packed)
+		expansion.output[total] = '\n';
+	fwrite(expansion.output, 1, size, file);
+
+	free(expansion.output);
+	free(tasks);
+	free(pieces);
+	return 1;
+}
+
+// packed output is padded with zeroes, ascii output ends with a newline
+static void write_expanded(struct term *term, struct bloc_parsed *bloc,
+			   FILE *file, int packed)
+{
+	struct blc_writer writer = { .packed = packed };
+	init_bits(&writer.out, file);
+	struct expander expander;
+	init_expander(&expander, bloc, &writer, EXPAND_CACHE_SIZE);
+	expand_term(&expander, term);
+	destroy_expander(&expander);
+
+	if (!packed)
+		write_byte('\n', &writer.out);
+	finish_bits(&writer.out);
+}
+
+void write_blc(struct bloc_parsed *bloc, FILE *file, int packed)
+{
+	if (write_parallel(bloc, file, packed))
+		return;
+	write_expanded(bloc_entry(bloc, bloc->length - 1), bloc, file, packed);
+}
+
+// the term may not contain references
+void write_term_blc(struct term *term, FILE *file, int packed)
 {
-	fprint_bloc_blc(bloc->entries[bloc->length - 1], bloc, file);
-	fprintf(file, "\n");
+	write_expanded(term, 0, file, packed);
 }
@@ -1,10 +1,16 @@
 // Copyright (c) 2023, Marvin Borner <dev@marvinborner.de>
 // SPDX-License-Identifier: MIT
 
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
 #include <errno.h>
 #include <string.h>
 #include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <term.h>
 #include <optimize.h>
@@ -13,6 +19,7 @@
 #include <tree.h>
 #include <parse.h>
 #include <build.h>
+#include <reduce.h>
 
 // automatically generated using gengetopt
 #include "cmdline.h"
@@ -20,147 +27,306 @@
 // min size for a term to be considered for deduplication
 size_t min_size = 0;
 
-#define BUF_SIZE 1024
-static char *read_stdin(void)
-{
-	debug("reading from stdin\n");
-	char buffer[BUF_SIZE];
-	size_t size = 1;
-	char *string = malloc(sizeof(char) * BUF_SIZE);
-	if (!string)
-		fatal("out of memory!\n");
-	string[0] = '\0';
-	while (fgets(buffer, BUF_SIZE, stdin)) {
-		char *old = string;
-		size += strlen(buffer);
-		string = realloc(string, size);
-		if (!string) {
-			free(old);
-			return 0;
-		}
-		strcat(string, buffer);
-	}
+// share identical subterms while parsing
+int hash_consing = 0;
 
-	if (ferror(stdin)) {
-		free(string);
-		fatal("can't read from stdin\n");
-	}
-	return string;
-}
+// share subterms that only differ by a shift of their free indices
+int shift_sharing = 0;
 
-static char *read_file(FILE *f)
+// write references using a variable-width code
+int varint_refs = 0;
+
+// reduce subterms before the deduplication if that makes them smaller
+int reduce = 0;
+
+// number of worker threads
+size_t threads = 1;
+
+// program input, either mapped read-only or read into a buffer
+struct input {
+	char *data;
+	size_t length;
+	int mapped;
+};
+
+// regular files get mapped, everything else (pipes etc.) is read into a
+// geometrically growing buffer
+#define BUF_SIZE (64 << 10)
+static void read_fd(int fd, struct input *input)
 {
-	fseek(f, 0, SEEK_END);
-	long fsize = ftell(f);
-	fseek(f, 0, SEEK_SET);
+	struct stat st;
+	if (fstat(fd, &st))
+		fatal("can't stat input: %s\n", strerror(errno));
+
+	if (S_ISREG(st.st_mode) && st.st_size > 0) {
+		input->length = st.st_size;
+		input->data = mmap(0, input->length, PROT_READ, MAP_PRIVATE,
+				   fd, 0);
+		if (input->data == MAP_FAILED)
+			fatal("can't map input: %s\n", strerror(errno));
+		posix_madvise(input->data, input->length,
+			      POSIX_MADV_SEQUENTIAL);
+		input->mapped = 1;
+		return;
+	}
 
-	char *string = malloc(fsize + 1);
-	if (!string)
+	size_t capacity = BUF_SIZE;
+	input->length = 0;
+	input->data = malloc(capacity);
+	input->mapped = 0;
+	if (!input->data)
 		fatal("out of memory!\n");
-	int ret = fread(string, fsize, 1, f);
 
-	if (ret != 1) {
-		free(string);
-		fatal("can't read file: %s\n", strerror(errno));
+	ssize_t ret;
+	while ((ret = read(fd, input->data + input->length,
+			   capacity - input->length))) {
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			fatal("can't read input: %s\n", strerror(errno));
+		}
+		input->length += ret;
+		if (input->length == capacity) {
+			capacity *= 2;
+			input->data = realloc(input->data, capacity);
+			if (!input->data)
+				fatal("out of memory!\n");
+		}
 	}
+}
 
-	string[fsize] = 0;
-	return string;
+static void read_stdin(struct input *input)
+{
+	debug("reading from stdin\n");
+	read_fd(STDIN_FILENO, input);
+}
+
+static void read_file(FILE *f, struct input *input)
+{
+	fflush(f);
+	read_fd(fileno(f), input);
 }
 
-static char *read_path(const char *path)
+static void read_path(const char *path, struct input *input)
 {
 	debug("reading from %s\n", path);
-	FILE *f = fopen(path, "rb");
-	if (!f)
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
 		fatal("can't open file %s: %s\n", path, strerror(errno));
-	char *string = read_file(f);
-	fclose(f);
-	return string;
+	read_fd(fd, input);
+	close(fd);
+}
+
+static void free_input(struct input *input)
+{
+	if (input->mapped)
+		munmap(input->data, input->length);
+	else
+		free(input->data);
 }
 
-static void test(char *input)
+// the reduced term is written to a temporary packed blc file
+static FILE *reduce_input(struct input *input, int packed)
 {
+	struct term *term = parse_blc(input->data, input->length, packed);
+	free_input(input);
+
+	debug("reducing term\n");
+	struct arena arena;
+	arena_init(&arena);
+	reduce_term(term, &arena);
+
+	FILE *temp = tmpfile();
+	write_term_blc(term, temp, 1);
+	arena_destroy(&arena);
+	free_blc(term);
+	rewind(temp);
+	return temp;
+}
+
+static void test(struct input *input, int packed, int flags)
+{
+	// the reduced term is compared instead
+	struct input reduced;
+	if (reduce) {
+		FILE *temp = reduce_input(input, packed);
+		read_file(temp, &reduced);
+		fclose(temp);
+		input = &reduced;
+		packed = 1;
+	}
+
 	debug("parsing as blc\n");
 
-	struct term *parsed_1 = parse_blc(input);
-	free(input);
+	struct term *parsed_1 = parse_blc(input->data, input->length, packed);
 	debug("parsed original blc\n");
 
 	debug("merging duplicates\n");
-	void *all_trees = 0;
-	struct tree *tree = tree_merge_duplicates(parsed_1, &all_trees);
+	struct blc_stream stream;
+	blc_stream_buffer(&stream, input->data, input->length, packed);
+	struct tree *tree = tree_merge_duplicates(&stream);
+	free_input(input);
 
 	debug("optimizing tree\n");
-	struct list *table = optimize_tree(tree, &all_trees);
+	struct table *table = optimize_tree(tree);
 
 	FILE *temp_bloc = tmpfile();
-	write_bloc(table, temp_bloc);
-	tree_destroy(table);
+	write_bloc(tree, table, temp_bloc, flags);
+	free_table(table);
+	tree_destroy(tree);
 
 	debug("parsing as bloc\n");
-	char *temp = read_file(temp_bloc);
-	struct bloc_parsed *bloc = parse_bloc(temp);
+	struct input temp;
+	read_file(temp_bloc, &temp);
+	struct bloc_parsed *bloc = parse_bloc(temp.data, temp.length, 0);
 	fseek(temp_bloc, 0, SEEK_END);
 	fprintf(stderr, "size bloc: %lu\n", ftell(temp_bloc));
 	fclose(temp_bloc);
+	free_input(&temp);
 
 	FILE *temp_blc = tmpfile();
-	write_blc(bloc, temp_blc);
-	char *input_2 = read_file(temp_blc);
-	struct term *parsed_2 = parse_blc(input_2);
+	write_blc(bloc, temp_blc, 0);
+	free_bloc(bloc);
+	struct input input_2;
+	read_file(temp_blc, &input_2);
+	struct term *parsed_2 = parse_blc(input_2.data, input_2.length, 0);
 	fseek(temp_blc, 0, SEEK_END);
 	fprintf(stderr, "size blc: %lu\n", ftell(temp_blc) / 8 + 1);
 	fclose(temp_blc);
-	free(input_2);
+	free_input(&input_2);
 	debug("parsed reconstructed blc\n");
 
 	diff_term(parsed_1, parsed_2);
 	debug("diffed two terms\n");
 
-	free_term(parsed_1);
-	free_term(parsed_2);
+	free_blc(parsed_1);
+	free_blc(parsed_2);
 	debug("done!\n");
 }
 
-static void from_blc(char *input, char *output_path)
+static void encode(struct blc_stream *stream, FILE *file, int flags)
 {
-	debug("parsing as blc\n");
+	debug("merging duplicates\n");
+	struct tree *tree = tree_merge_duplicates(stream);
 
-	struct term *parsed = parse_blc(input);
-	debug("parsed blc\n");
+	debug("optimizing tree\n");
+	struct table *table = optimize_tree(tree);
+
+	write_bloc(tree, table, file, flags);
+	free_table(table);
+	tree_destroy(tree);
+}
+
+static void copy_file(FILE *from, FILE *to)
+{
+	char *buffer = malloc(BUF_SIZE);
+	if (!buffer)
+		fatal("out of memory!\n");
+	rewind(from);
+	size_t length;
+	while ((length = fread(buffer, 1, BUF_SIZE, from)))
+		fwrite(buffer, 1, length, to);
+	free(buffer);
+}
+
+// both the original and the reduced term get encoded, the smaller bloc is
+// kept as the reduction might break up shared subterms
+static void from_blc_reduced(struct input *input, FILE *file, int packed,
+			     int flags)
+{
+	// the chunk buffer is too big for the stack
+	struct blc_stream *stream = malloc(sizeof(*stream));
+	if (!stream)
+		fatal("out of memory!\n");
+
+	FILE *original = tmpfile();
+	blc_stream_buffer(stream, input->data, input->length, packed);
+	encode(stream, original, flags);
+
+	FILE *term = reduce_input(input, packed);
+	FILE *reduced = tmpfile();
+	blc_stream_file(stream, term, 1);
+	encode(stream, reduced, flags);
+	fclose(term);
+	free(stream);
+
+	long original_size = ftell(original);
+	long reduced_size = ftell(reduced);
+	debug("size reduced: %ld, original: %ld\n", reduced_size,
+	      original_size);
+	copy_file(reduced_size < original_size ? reduced : original, file);
+	fclose(original);
+	fclose(reduced);
+}
+
+// the input is streamed directly into the merkle tree
+static void from_blc(char *input_path, char *output_path, int packed,
+		     int flags)
+{
+	if (reduce) {
+		struct input input;
+		if (input_path[0] == '-')
+			read_stdin(&input);
+		else
+			read_path(input_path, &input);
+		FILE *file = output_path ? fopen(output_path, "wb") : stdout;
+		from_blc_reduced(&input, file, packed, flags);
+		fclose(file);
+		debug("done!\n");
+		return;
+	}
+
+	debug("streaming blc from %s\n", input_path);
+
+	FILE *input = stdin;
+	if (input_path[0] != '-') {
+		input = fopen(input_path, "rb");
+		if (!input)
+			fatal("can't open file %s: %s\n", input_path,
+			      strerror(errno));
+	}
+
+	// the chunk buffer is too big for the stack
+	struct blc_stream *stream = malloc(sizeof(*stream));
+	if (!stream)
+		fatal("out of memory!\n");
+	blc_stream_file(stream, input, packed);
 
 	debug("merging duplicates\n");
-	void *all_trees = 0;
-	struct tree *tree = tree_merge_duplicates(parsed, &all_trees);
+	struct tree *tree = tree_merge_duplicates(stream);
+	free(stream);
+	if (input != stdin)
+		fclose(input);
 
 	debug("optimizing tree\n");
-	struct list *table = optimize_tree(tree, &all_trees);
+	struct table *table = optimize_tree(tree);
 
 	FILE *file = output_path ? fopen(output_path, "wb") : stdout;
-	write_bloc(table, file);
+	write_bloc(tree, table, file, flags);
 	fclose(file);
 
-	tree_destroy(table);
-	free_term(parsed);
-	free(input);
+	free_table(table);
+	tree_destroy(tree);
 
 	debug("done!\n");
 }
 
-static void from_bloc(char *input, char *output_path, int dump)
+static void from_bloc(struct input *input, char *output_path, int dump,
+		      int packed)
 {
 	debug("parsing as bloc\n");
 
-	struct bloc_parsed *bloc = parse_bloc(input);
+	// only the entries reachable from the final one are decoded
+	struct bloc_parsed *bloc =
+		parse_bloc(input->data, input->length, !dump);
 	if (dump)
 		print_bloc(bloc);
 
 	FILE *file = output_path ? fopen(output_path, "wb") : stdout;
-	write_blc(bloc, file);
+	write_blc(bloc, file, packed);
 	fclose(file);
 
-	free(input);
+	free_input(input);
 	free_bloc(bloc);
 }
 
@@ -172,31 +338,51 @@ int main(int argc, char **argv)
 
 	debug_enable(args.verbose_flag);
 
-	char *input;
-	if (args.input_arg[0] == '-') {
-		input = read_stdin();
-	} else {
-		input = read_path(args.input_arg);
-	}
-
-	if (!input)
-		return 1;
-
 	min_size = args.min_size_arg;
 	debug("min tree size: %lu\n", min_size);
-
-	if (args.test_flag && args.from_blc_flag && !args.from_bloc_flag) {
-		test(input);
+	hash_consing = args.hash_cons_flag;
+	shift_sharing = args.shift_flag;
+	varint_refs = args.varint_refs_flag;
+	reduce = args.reduce_flag;
+	if (hash_consing && shift_sharing)
+		fatal("invalid options: can't hash-cons shifted subterms\n");
+
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+	if (args.threads_arg > 0)
+		threads = args.threads_arg;
+	else if (cores > 0)
+		threads = cores;
+	debug("threads: %lu\n", threads);
+
+	int flags = args.index_flag ? BLOC_FLAG_INDEX : 0;
+	if (shift_sharing)
+		flags |= BLOC_FLAG_SHIFT;
+	if (varint_refs)
+		flags |= BLOC_FLAG_VARINT;
+	if (args.unpadded_flag)
+		flags |= BLOC_FLAG_UNPADDED;
+
+	if (args.from_blc_flag && !args.from_bloc_flag && !args.test_flag) {
+		from_blc(args.input_arg, args.output_arg,
+			 args.packed_input_flag, flags);
 		return 0;
 	}
 
-	if (args.from_blc_flag && !args.from_bloc_flag) {
-		from_blc(input, args.output_arg);
+	struct input input;
+	if (args.input_arg[0] == '-') {
+		read_stdin(&input);
+	} else {
+		read_path(args.input_arg, &input);
+	}
+
+	if (args.test_flag && args.from_blc_flag && !args.from_bloc_flag) {
+		test(&input, args.packed_input_flag, flags);
 		return 0;
 	}
 
 	if (args.from_bloc_flag && !args.from_blc_flag) {
-		from_bloc(input, args.output_arg, args.dump_flag);
+		from_bloc(&input, args.output_arg, args.dump_flag,
+			  args.packed_output_flag);
 		return 0;
 	}
 
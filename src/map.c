@@ -0,0 +1,107 @@
+// Copyright (c) 2023, Marvin Borner <dev@marvinborner.de>
+// SPDX-License-Identifier: MIT
+
+// keys are already well-distributed hashes, so their low bits are used as
+// slot directly and collisions are resolved by linear probing
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <log.h>
+#include <map.h>
+
+#define MAP_MIN_CAPACITY 64
+
+static void map_alloc(struct map *map, size_t capacity)
+{
+	map->length = 0;
+	map->capacity = capacity;
+	map->keys = malloc(capacity * sizeof(*map->keys));
+	map->used = calloc(capacity, sizeof(*map->used));
+	map->values = malloc(capacity * map->value_size);
+	if (!map->keys || !map->used || !map->values)
+		fatal("out of memory!\n");
+}
+
+// preallocates enough slots for the expected amount of keys
+void map_init(struct map *map, size_t value_size, size_t expected)
+{
+	size_t capacity = MAP_MIN_CAPACITY;
+	while (capacity / 4 * 3 < expected)
+		capacity *= 2;
+	map->value_size = value_size;
+	map_alloc(map, capacity);
+}
+
+void map_destroy(struct map *map)
+{
+	free(map->keys);
+	free(map->used);
+	free(map->values);
+}
+
+static size_t map_slot(const struct map *map, hash_t key)
+{
+	size_t mask = map->capacity - 1;
+	size_t slot = key & mask;
+	while (map->used[slot] && map->keys[slot] != key)
+		slot = (slot + 1) & mask;
+	return slot;
+}
+
+static void map_grow(struct map *map)
+{
+	struct map old = *map;
+	map_alloc(map, old.capacity * 2);
+	for (size_t i = 0; i < old.capacity; i++) {
+		if (!old.used[i])
+			continue;
+		size_t slot = map_slot(map, old.keys[i]);
+		map->keys[slot] = old.keys[i];
+		map->used[slot] = 1;
+		memcpy(map->values + slot * map->value_size,
+		       old.values + i * old.value_size, old.value_size);
+	}
+	map->length = old.length;
+	map_destroy(&old);
+}
+
+// returns the value of key, found is 0 if it was newly inserted
+// the value of a new key is uninitialized
+void *map_insert(struct map *map, hash_t key, int *found)
+{
+	if (map->length + 1 > map->capacity / 4 * 3)
+		map_grow(map);
+
+	size_t slot = map_slot(map, key);
+	*found = map->used[slot];
+	if (!*found) {
+		map->keys[slot] = key;
+		map->used[slot] = 1;
+		map->length++;
+	}
+	return map->values + slot * map->value_size;
+}
+
+void *map_find(const struct map *map, hash_t key)
+{
+	size_t slot = map_slot(map, key);
+	if (!map->used[slot])
+		return 0;
+	return map->values + slot * map->value_size;
+}
+
+// iterates the values in slot order, position has to start at 0
+// key is optional and set to the value's key
+void *map_next(const struct map *map, size_t *position, hash_t *key)
+{
+	while (*position < map->capacity) {
+		size_t slot = (*position)++;
+		if (!map->used[slot])
+			continue;
+		if (key)
+			*key = map->keys[slot];
+		return map->values + slot * map->value_size;
+	}
+	return 0;
+}
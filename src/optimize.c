@@ -4,166 +4,211 @@
 // most of the actual optimizing is done in tree.c
 // this file does some extra steps to optimize the tree even further
 
-#include <search.h>
 #include <assert.h>
 #include <stdlib.h>
 
+#include <build.h>
 #include <hash.h>
 #include <log.h>
+#include <map.h>
 #include <optimize.h>
-#include <pqueue.h>
 
 struct tree_tracker {
-	hash_t hash;
-	struct tree *tree;
+	uint32_t tree;
+	uint32_t referrer; // tree of the first reference
 	int count; // reference/occurrence count
-	size_t position; // in queue
 };
 
-struct hash_to_tree {
-	hash_t hash;
-	struct tree *tree;
+// state of generate_index_mappings, pending entries still have to be walked
+struct index_mapper {
+	struct map set;
+	uint32_t *pending;
+	size_t pending_length;
 };
 
-// comparison_fn_t for tsearch
-static int hash_compare(const void *_a, const void *_b)
+// tree_walk callback, references are counted instead of walked
+static int count_reference(struct tree *tree, uint32_t i, void *data)
 {
-	const struct tree_tracker *a = _a;
-	const struct tree_tracker *b = _b;
-
-	if (a->hash < b->hash)
-		return -1;
-	if (a->hash > b->hash)
+	if (tree->ref[i] == TREE_NONE)
 		return 1;
+
+	// increase count of reference, entries are keyed by their tree as
+	// different entries may have equal hashes
+	struct index_mapper *mapper = data;
+	int found;
+	struct tree_tracker *element =
+		map_insert(&mapper->set, tree->ref[i], &found);
+	if (!found) { // first of its kind
+		element->count = 1;
+		element->tree = tree->ref[i];
+		element->referrer = i;
+		assert(tree->ref[element->tree] == TREE_NONE);
+		mapper->pending[mapper->pending_length++] = element->tree;
+	} else {
+		element->count++;
+	}
 	return 0;
 }
 
-// constructs a tree/map/set of all hashes and their occurrence count
-// this is needed because the index count changes (currently untracked, see README)
-// during tree invalidation and less used indices should get shorter encodings
-static void generate_index_mappings(struct tree *tree, void **all_trees,
-				    void **set)
+// constructs a tree/map/set of all hashes and their reference count
+// every entry is walked once, so the count is the amount of references that
+// actually get written -- the most written ones get the shortest encodings
+static void generate_index_mappings(struct tree *tree,
+				    struct index_mapper *mapper)
 {
-	switch (tree->type) {
-	case ABS:
-		generate_index_mappings(tree->u.abs.term, all_trees, set);
-		break;
-	case APP:
-		generate_index_mappings(tree->u.app.lhs, all_trees, set);
-		generate_index_mappings(tree->u.app.rhs, all_trees, set);
-		break;
-	case VAR:
-		break;
-	case REF:;
-		// increase count of reference
-		struct tree_tracker *element = malloc(sizeof(*element));
-		if (!element)
-			fatal("out of memory!\n");
-		element->hash = tree->u.ref.hash;
-		struct tree_tracker **handle =
-			tsearch(element, set, hash_compare);
-		if (*handle == element) { // first of its kind
-			struct hash_to_tree *tree_element =
-				malloc(sizeof(*tree_element));
-			tree_element->hash = tree->u.ref.hash;
-			struct hash_to_tree **ref_tree =
-				tfind(element, all_trees, hash_compare);
-			if (!ref_tree)
-				fatal("referred tree not found!\n");
-			free(tree_element);
-
-			element->count = 1;
-			element->tree = (*ref_tree)->tree;
-			assert(element->tree);
-			generate_index_mappings(element->tree, all_trees, set);
-		} else {
-			free(element); // already exists, not needed
-			(*handle)->count++;
-		}
-		break;
-	default:
-		fatal("invalid type %d\n", tree->type);
+	// every entry is pending at most once
+	mapper->pending = malloc(tree->length * sizeof(*mapper->pending));
+	if (!mapper->pending)
+		fatal("out of memory!\n");
+	mapper->pending_length = 0;
+
+	struct walk_stack stack;
+	walk_stack_init(&stack);
+	tree_walk(tree, tree->root, count_reference, 0, mapper, &stack);
+	while (mapper->pending_length) {
+		uint32_t entry = mapper->pending[--mapper->pending_length];
+		tree_walk(tree, entry, count_reference, 0, mapper, &stack);
 	}
+	walk_stack_destroy(&stack);
+	free(mapper->pending);
 }
 
-// sets corresponding table_index of references
-static void fix_tree(struct tree *tree, void **set)
+// entries with a single reference only cost padding and the reference, so
+// their referrer gets written in full instead -- the entries inside it may
+// end up with a single reference as well, and shifted referrers contain
+// different references than their entry, so it's repeated until none are
+// left
+static void generate_inlined_mappings(struct tree *tree,
+				      struct index_mapper *mapper)
 {
-	switch (tree->type) {
-	case ABS:
-		fix_tree(tree->u.abs.term, set);
-		break;
-	case APP:
-		fix_tree(tree->u.app.lhs, set);
-		fix_tree(tree->u.app.rhs, set);
-		break;
-	case VAR:
-		break;
-	case REF:;
-		struct tree_tracker *element = malloc(sizeof(*element));
-		element->hash = tree->u.ref.hash;
-		if (!element)
-			fatal("out of memory!\n");
-		struct tree_tracker **handle =
-			tfind(element, set, hash_compare);
-		assert(handle); // must exist
-		free(element);
-		tree->u.ref.table_index = (*handle)->position;
-		fix_tree((*handle)->tree, set);
-		break;
-	default:
-		fatal("invalid type %d\n", tree->type);
+	// every round has about as many entries as the previous one
+	size_t expected = tree->shared;
+	while (1) {
+		map_init(&mapper->set, sizeof(struct tree_tracker), expected);
+		generate_index_mappings(tree, mapper);
+
+		size_t position = 0, inlined = 0;
+		struct tree_tracker *element;
+		while ((element = map_next(&mapper->set, &position, 0))) {
+			if (element->count != 1)
+				continue;
+			tree->ref[element->referrer] = TREE_NONE;
+			inlined++;
+		}
+		debug("inlined %lu entries\n", inlined);
+		if (!inlined)
+			return;
+		expected = mapper->set.length;
+		map_destroy(&mapper->set);
 	}
 }
 
-// priority of candidate -> occurrence count
-static pqueue_pri_t get_pri(void *a)
+// byte of the inverted count, so that ascending order is descending count
+static int count_byte(const struct tree_tracker *tracker, int shift)
 {
-	return ((struct tree_tracker *)a)->count;
+	return (~(uint32_t)tracker->count >> shift) & 0xff;
 }
 
-static int cmp_pri(pqueue_pri_t next, pqueue_pri_t curr)
+// sorts the trackers by descending count in linear time, using a stable
+// lsd radix sort over the bytes of the count
+static void sort_trackers(struct tree_tracker **trackers, size_t length)
 {
-	return next < curr;
-}
+	if (length < 2)
+		return;
 
-static void set_pos(void *a, size_t pos)
-{
-	((struct tree_tracker *)a)->position = pos - 1;
-}
+	struct tree_tracker **buffer = malloc(length * sizeof(*buffer));
+	if (!buffer)
+		fatal("out of memory!\n");
 
-static struct pqueue *set_queue; // i know this is stupid but tsearch is stupider
-static void walk(void *data, VISIT which, int depth)
-{
-	(void)depth;
-	if (which != preorder && which != leaf)
-		return;
+	for (int shift = 0; shift < 32; shift += 8) {
+		size_t offsets[256] = { 0 };
+		for (size_t i = 0; i < length; i++)
+			offsets[count_byte(trackers[i], shift)]++;
+
+		size_t sum = 0;
+		for (int bucket = 0; bucket < 256; bucket++) {
+			const size_t n = offsets[bucket];
+			offsets[bucket] = sum;
+			sum += n;
+		}
+
+		for (size_t i = 0; i < length; i++)
+			buffer[offsets[count_byte(trackers[i], shift)]++] =
+				trackers[i];
 
-	struct tree_tracker *element = *(struct tree_tracker **)data;
-	// TODO: Merge elements with =1 references
-	if (element->count) { // only insert elements with references
-		pqueue_insert(set_queue, element);
+		struct tree_tracker **swap = trackers;
+		trackers = buffer;
+		buffer = swap;
 	}
+
+	// even amount of passes, the result is in the original array
+	free(buffer);
 }
 
-struct list *optimize_tree(struct tree *tree, void **all_trees)
+// the order of the variable-width references that results in the fewest
+// bits, given the sorted reference counts
+#define MAX_VARINT_ORDER 16
+static int varint_order(struct tree_tracker **sorted, size_t length)
 {
-	void *set = 0;
-	generate_index_mappings(tree, all_trees, &set);
-
-	// pqueue from mappings: hash -> tree_tracker
-	set_queue = pqueue_init(2 << 7, cmp_pri, get_pri, set_pos);
-	twalk(set, walk);
+	int best = 0;
+	uint64_t best_bits = UINT64_MAX;
+	for (int order = 0; order <= MAX_VARINT_ORDER; order++) {
+		uint64_t bits = 0;
+		for (size_t i = 0; i < length; i++)
+			bits += (uint64_t)sorted[i]->count *
+				varint_bits(i, order);
+		if (bits < best_bits) {
+			best = order;
+			best_bits = bits;
+		}
+	}
+	return best;
+}
 
-	fix_tree(tree, &set);
+struct table *optimize_tree(struct tree *tree)
+{
+	struct index_mapper mapper;
+	generate_inlined_mappings(tree, &mapper);
+	struct map set = mapper.set;
+
+	// sort the mappings: hash -> tree_tracker
+	struct tree_tracker **sorted = malloc(set.length * sizeof(*sorted));
+	if (!sorted && set.length)
+		fatal("out of memory!\n");
+	size_t position = 0, length = 0;
+	struct tree_tracker *element;
+	while ((element = map_next(&set, &position, 0)))
+		sorted[length++] = element;
+	sort_trackers(sorted, length);
+
+	struct table *table = malloc(sizeof(*table));
+	if (!table)
+		fatal("out of memory!\n");
+	table->length = length + 1;
+	table->entries = malloc(table->length * sizeof(*table->entries));
+	table->index = malloc(tree->length * sizeof(*table->index));
+	if (!table->entries || !table->index)
+		fatal("out of memory!\n");
+
+	// sets corresponding table_index of references
+	// the most referenced entry gets the smallest index and is written last
+	for (size_t i = 0; i < length; i++) {
+		table->entries[length - i - 1] = sorted[i]->tree;
+		table->index[sorted[i]->tree] = i;
+	}
+	table->entries[table->length - 1] = tree->root;
+	table->index[tree->root] = TREE_NONE;
+	table->order = varint_order(sorted, length);
 
-	struct list *list = list_add(0, tree);
+	free(sorted);
+	map_destroy(&set);
 
-	for (size_t i = 1; i < pqueue_size(set_queue) + 1; i++) {
-		struct tree_tracker *element = set_queue->d[i];
-		list = list_add(list, element->tree);
-	}
-	pqueue_free(set_queue);
+	return table;
+}
 
-	return list;
+void free_table(struct table *table)
+{
+	free(table->entries);
+	free(table->index);
+	free(table);
 }
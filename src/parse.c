@@ -1,6 +1,7 @@
 // Copyright (c) 2023, Marvin Borner <dev@marvinborner.de>
 // SPDX-License-Identifier: MIT
 
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -8,120 +9,706 @@
 #include <term.h>
 #include <spec.h>
 #include <parse.h>
+#include <pool.h>
 #include <log.h>
 
-static struct term *rec_blc(const char **term)
-{
-	struct term *res = 0;
-	if (!**term) {
-		fatal("invalid parsing state!\n");
-	} else if (**term == '0' && *(*term + 1) == '0') {
-		(*term) += 2;
-		res = new_term(ABS);
-		res->u.abs.term = rec_blc(term);
-	} else if (**term == '0' && *(*term + 1) == '1') {
-		(*term) += 2;
-		res = new_term(APP);
-		res->u.app.lhs = rec_blc(term);
-		res->u.app.rhs = rec_blc(term);
-	} else if (**term == '1') {
-		const char *cur = *term;
-		while (**term == '1')
-			(*term)++;
-		res = new_term(VAR);
-		res->u.var.index = *term - cur - 1;
-		(*term)++;
+// pushes a hole that still needs to be filled by a parsed term
+static void push_hole(struct term ****stack, size_t *depth, size_t *capacity,
+		      struct term **hole)
+{
+	if (*depth == *capacity) {
+		*capacity *= 2;
+		*stack = realloc(*stack, *capacity * sizeof(**stack));
+		if (!*stack)
+			fatal("out of memory!\n");
+	}
+	(*stack)[(*depth)++] = hole;
+}
+
+void blc_stream_file(struct blc_stream *stream, FILE *file, int packed)
+{
+	stream->file = file;
+	stream->data = stream->chunk;
+	stream->length = 0;
+	stream->position = 0;
+	stream->packed = packed;
+	stream->bits = 0;
+}
+
+void blc_stream_buffer(struct blc_stream *stream, const char *data,
+		       size_t length, int packed)
+{
+	stream->file = 0;
+	stream->data = data;
+	stream->length = length;
+	stream->position = 0;
+	stream->packed = packed;
+	stream->bits = 0;
+}
+
+// returns the next character or EOF, refills the chunk when necessary
+static int stream_char(struct blc_stream *stream)
+{
+	if (stream->position == stream->length) {
+		if (!stream->file)
+			return EOF;
+		stream->length =
+			fread(stream->chunk, 1, BLC_CHUNK_SIZE, stream->file);
+		stream->position = 0;
+		if (!stream->length) {
+			if (ferror(stream->file))
+				fatal("can't read input\n");
+			return EOF;
+		}
+	}
+	return (unsigned char)stream->data[stream->position++];
+}
+
+// returns the next bit (msb first) of packed input or EOF
+static int stream_bit(struct blc_stream *stream)
+{
+	if (!stream->bits) {
+		int c = stream_char(stream);
+		if (c == EOF)
+			return EOF;
+		stream->byte = c;
+		stream->bits = 8;
+	}
+	return (stream->byte >> --stream->bits) & 1;
+}
+
+static term_type packed_next(struct blc_stream *stream, int *index)
+{
+	int b = stream_bit(stream);
+	if (b == 1) {
+		int ones = 1;
+		while ((b = stream_bit(stream)) == 1)
+			ones++;
+		*index = ones - 1;
+		return VAR;
+	}
+	if (b == EOF)
+		return INV;
+
+	b = stream_bit(stream);
+	if (b == EOF)
+		return INV;
+	return b ? APP : ABS;
+}
+
+// same grammar as parse_blc, unknown characters are skipped
+term_type blc_stream_next(struct blc_stream *stream, int *index)
+{
+	if (stream->packed)
+		return packed_next(stream, index);
+
+	int c;
+	while ((c = stream_char(stream)) != EOF) {
+		if (c == '1') {
+			int ones = 1;
+			while ((c = stream_char(stream)) == '1')
+				ones++;
+			*index = ones - 1;
+			return VAR;
+		}
+		if (c != '0')
+			continue;
+
+		c = stream_char(stream);
+		if (c == '0')
+			return ABS;
+		if (c == '1')
+			return APP;
+	}
+	return INV;
+}
+
+// every term needs at least two characters (or bits), so the amount of terms
+// is bounded by the input length -- all terms are bump-allocated in one block
+// instead of mallocing every single one, the root is always the first term
+struct term *parse_blc(const char *term, size_t length, int packed)
+{
+	struct blc_stream *stream = malloc(sizeof(*stream));
+	if (!stream)
+		fatal("out of memory!\n");
+	blc_stream_buffer(stream, term, length, packed);
+
+	const size_t capacity = (packed ? length * 4 : length / 2) + 1;
+	struct term *terms = malloc(capacity * sizeof(*terms));
+	if (!terms)
+		fatal("out of memory!\n");
+	size_t count = 0;
+
+	// explicit stack of holes, deep application spines can't overflow it
+	size_t depth = 0, stack_capacity = 64;
+	struct term ***stack = malloc(stack_capacity * sizeof(*stack));
+	if (!stack)
+		fatal("out of memory!\n");
+
+	struct term *root = 0;
+	push_hole(&stack, &depth, &stack_capacity, &root);
+	while (depth) {
+		int index;
+		term_type type = blc_stream_next(stream, &index);
+		if (type == INV || count == capacity)
+			fatal("invalid parsing state!\n");
+
+		struct term *res = &terms[count++];
+		res->type = type;
+		*stack[--depth] = res;
+		if (type == ABS) {
+			push_hole(&stack, &depth, &stack_capacity,
+				  &res->u.abs.term);
+		} else if (type == APP) {
+			// rhs gets popped after lhs
+			push_hole(&stack, &depth, &stack_capacity,
+				  &res->u.app.rhs);
+			push_hole(&stack, &depth, &stack_capacity,
+				  &res->u.app.lhs);
+		} else {
+			res->u.var.index = index;
+		}
+	}
+
+	free(stack);
+	free(stream);
+	return root;
+}
+
+void free_blc(struct term *term)
+{
+	free(term);
+}
+
+// buffered msb-first bit reader over a byte buffer
+struct bit_reader {
+	const uint8_t *data;
+	size_t length; // in bytes
+	size_t bit; // current position
+	int flags; // of the bloc header
+	int order; // of variable-width references
+};
+
+// returns the next 64 bits without consuming them, zeroes after the end
+static uint64_t peek_bits(const struct bit_reader *reader)
+{
+	const size_t byte = reader->bit / 8;
+	const int shift = reader->bit % 8;
+	uint64_t word = 0;
+	uint8_t next = 0;
+	if (byte + 9 <= reader->length) {
+		memcpy(&word, reader->data + byte, sizeof(word));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+		word = __builtin_bswap64(word);
+#endif
+		next = reader->data[byte + 8];
 	} else {
-		(*term)++;
-		res = rec_blc(term);
+		for (size_t i = 0; i < 8; i++)
+			word = (word << 8) | (byte + i < reader->length ?
+						      reader->data[byte + i] :
+						      0);
+		if (byte + 8 < reader->length)
+			next = reader->data[byte + 8];
+	}
+	if (shift)
+		word = (word << shift) | (next >> (8 - shift));
+	return word;
+}
+
+static uint64_t reverse_bits(uint64_t x)
+{
+	x = ((x >> 1) & 0x5555555555555555) | ((x & 0x5555555555555555) << 1);
+	x = ((x >> 2) & 0x3333333333333333) | ((x & 0x3333333333333333) << 2);
+	x = ((x >> 4) & 0x0f0f0f0f0f0f0f0f) | ((x & 0x0f0f0f0f0f0f0f0f) << 4);
+	return __builtin_bswap64(x);
+}
+
+// consumes a run of ones and its terminating zero, returns 0 on truncated
+// input -- runs longer than a word are rare
+static int read_ones(struct bit_reader *reader, size_t *ones)
+{
+	uint64_t word = peek_bits(reader);
+	int run;
+	*ones = 0;
+	while ((run = ~word ? __builtin_clzll(~word) : 64) == 64) {
+		if (reader->bit / 8 >= reader->length)
+			return 0;
+		*ones += 64;
+		reader->bit += 64;
+		word = peek_bits(reader);
+	}
+	*ones += run;
+	reader->bit += run + 1;
+	return 1;
+}
+
+// reads the msb-first number in the next bits
+static uint64_t read_number(struct bit_reader *reader, int bits)
+{
+	if (!bits)
+		return 0;
+	const uint64_t number = peek_bits(reader) >> (64 - bits);
+	reader->bit += bits;
+	return number;
+}
+
+// reads the exponential golomb code of a reference's index (and its shift)
+static int read_varint_ref(struct bit_reader *reader, size_t *index,
+			   size_t *shift)
+{
+	size_t length;
+	if (!read_ones(reader, &length) || length + reader->order > 63)
+		return 0;
+	const uint64_t value = (1ULL << length | read_number(reader, length));
+	*index = (value - 1) << reader->order |
+		 read_number(reader, reader->order);
+
+	*shift = 0;
+	return !(reader->flags & BLOC_FLAG_SHIFT) || read_ones(reader, shift);
+}
+
+// reads the index of a reference (and its shift), see readme
+static int read_ref(struct bit_reader *reader, size_t *index, size_t *shift)
+{
+	if (reader->flags & BLOC_FLAG_VARINT)
+		return read_varint_ref(reader, index, shift);
+
+	uint64_t word = peek_bits(reader);
+	int sel = word >> 62;
+	reader->bit += 2;
+
+	// the 64-bit selector marks a shifted reference
+	const int shifted = sel == 3 && reader->flags & BLOC_FLAG_SHIFT;
+	if (shifted) {
+		word = peek_bits(reader);
+		sel = word >> 62;
+		reader->bit += 2;
 	}
-	return res;
+
+	// indices are stored lsb first
+	const int bits = 2 << (sel + 2);
+	word = peek_bits(reader);
+	*index = reverse_bits(word) & (~0ULL >> (64 - bits));
+	reader->bit += bits;
+
+	*shift = 0;
+	return !shifted || read_ones(reader, shift);
 }
 
-struct term *parse_blc(const char *term)
+// growable list of entry (or reference) indices
+struct entry_list {
+	size_t *entries;
+	size_t length;
+	size_t capacity;
+};
+
+static void push_entry(struct entry_list *list, size_t entry)
 {
-	return rec_blc(&term);
+	if (list->length == list->capacity) {
+		list->capacity = list->capacity ? list->capacity * 2 : 64;
+		list->entries =
+			realloc(list->entries,
+				list->capacity * sizeof(*list->entries));
+		if (!list->entries)
+			fatal("out of memory!\n");
+	}
+	list->entries[list->length++] = entry;
 }
 
-#define BIT_AT(i) ((term[(i) / 8] & (1 << (7 - ((i) % 8)))) >> (7 - ((i) % 8)))
+// type and length of the 3-bit prefixes, VAR's length depends on the index
+static const term_type prefix_type[8] = { APP, APP, ABS, REF,
+					  VAR, VAR, VAR, VAR };
+static const int prefix_length[8] = { 2, 2, 3, 3, 0, 0, 0, 0 };
 
 // parses bloc's bit-encoded blc
 // 010M -> abstraction of M
 // 00MN -> application of M and N
 // 1X0 -> bruijn index, amount of 1s in X
-// 011I -> 2B index to entry
-static struct term *parse_bloc_bblc(const char *term, size_t *bit)
-{
-	struct term *res = 0;
-	if (!BIT_AT(*bit) && BIT_AT(*bit + 1) && !BIT_AT(*bit + 2)) {
-		(*bit) += 3;
-		res = new_term(ABS);
-		res->u.abs.term = parse_bloc_bblc(term, bit);
-	} else if (!BIT_AT(*bit) && !BIT_AT(*bit + 1)) {
-		(*bit) += 2;
-		res = new_term(APP);
-		res->u.app.lhs = parse_bloc_bblc(term, bit);
-		res->u.app.rhs = parse_bloc_bblc(term, bit);
-	} else if (BIT_AT(*bit)) {
-		const size_t cur = *bit;
-		while (BIT_AT(*bit))
-			(*bit)++;
-		res = new_term(VAR);
-		res->u.var.index = *bit - cur - 1;
-		(*bit)++;
-	} else if (!BIT_AT(*bit) && BIT_AT(*bit + 1) && BIT_AT(*bit + 2)) {
-		(*bit) += 3;
-
-		// selected bit pattern, see readme
-		int sel = (2 << (BIT_AT(*bit) * 2 + BIT_AT(*bit + 1) + 2));
-		(*bit) += 2;
-
-		res = new_term(REF);
-		size_t index = 0;
-		for (int i = 0; i < sel; i++) {
-			index |= BIT_AT(*bit) << i;
-			(*bit) += 1;
+// 011I -> index to entry, optionally shifted
+// the indices of the references are collected if refs isn't 0
+static struct term *parse_bloc_bblc(struct bit_reader *reader,
+				    struct arena *arena,
+				    struct entry_list *refs)
+{
+	// explicit stack of holes, like in parse_blc
+	size_t depth = 0, capacity = 64;
+	struct term ***stack = malloc(capacity * sizeof(*stack));
+	if (!stack)
+		fatal("out of memory!\n");
+
+	struct term *root = 0;
+	push_hole(&stack, &depth, &capacity, &root);
+	while (depth) {
+		if (reader->bit / 8 >= reader->length)
+			fatal("invalid parsing state!\n");
+		uint64_t word = peek_bits(reader);
+		const int prefix = word >> 61;
+		struct term *res = new_term(arena, prefix_type[prefix]);
+		reader->bit += prefix_length[prefix];
+		*stack[--depth] = res;
+
+		switch (res->type) {
+		case ABS:
+			push_hole(&stack, &depth, &capacity, &res->u.abs.term);
+			break;
+		case APP:
+			// rhs gets popped after lhs
+			push_hole(&stack, &depth, &capacity, &res->u.app.rhs);
+			push_hole(&stack, &depth, &capacity, &res->u.app.lhs);
+			break;
+		case VAR:;
+			size_t ones;
+			if (!read_ones(reader, &ones))
+				fatal("invalid parsing state!\n");
+			res->u.var.index = ones - 1;
+			break;
+		case REF:
+			if (!read_ref(reader, &res->u.ref.index,
+				      &res->u.ref.shift))
+				fatal("invalid parsing state!\n");
+			if (refs)
+				push_entry(refs, res->u.ref.index);
+			break;
+		default:
+			fatal("invalid type %d\n", res->type);
 		}
-		res->u.ref.index = index;
-	} else {
-		(*bit)++;
-		res = parse_bloc_bblc(term, bit);
 	}
-	return res;
+
+	free(stack);
+	return root;
+}
+
+// entries are padded to full bytes unless they're one contiguous bitstream
+static void align_entry(struct bit_reader *reader)
+{
+	if (!(reader->flags & BLOC_FLAG_UNPADDED))
+		reader->bit = (reader->bit + 7) & ~(size_t)7;
 }
 
-struct bloc_parsed *parse_bloc(const void *bloc)
+// skips an entry without decoding it, returns 0 on truncated input
+static int skip_bloc_bblc(struct bit_reader *reader)
+{
+	size_t pending = 1, ones, index;
+	while (pending) {
+		if (reader->bit / 8 >= reader->length)
+			return 0;
+		uint64_t word = peek_bits(reader);
+		const int prefix = word >> 61;
+		reader->bit += prefix_length[prefix];
+
+		switch (prefix_type[prefix]) {
+		case ABS:
+			break;
+		case APP:
+			pending++;
+			break;
+		case VAR:
+			if (!read_ones(reader, &ones))
+				return 0;
+			pending--;
+			break;
+		case REF:
+			if (!read_ref(reader, &index, &ones))
+				return 0;
+			pending--;
+			break;
+		default:
+			return 0;
+		}
+	}
+	return 1;
+}
+
+// reads an LEB128 varint
+static size_t read_varint(const uint8_t **data, const uint8_t *end)
+{
+	size_t value = 0;
+	for (int shift = 0; *data < end && shift < 64; shift += 7) {
+		const uint8_t byte = *(*data)++;
+		value |= (size_t)(byte & 0x7f) << shift;
+		if (!(byte & 0x80))
+			return value;
+	}
+	fatal("invalid varint!\n");
+	return 0;
+}
+
+static uint64_t read_u64(const uint8_t *data)
+{
+	uint64_t value = 0;
+	for (int i = 7; i >= 0; i--)
+		value = (value << 8) | data[i];
+	return value;
+}
+
+// entries of an indexed bloc get decoded in parallel chunks
+#define DECODE_CHUNK 64
+struct decode_task {
+	struct bloc_parsed *parsed;
+	const uint8_t *data;
+	size_t length;
+	const uint64_t *offsets;
+};
+
+static void decode_entries(size_t chunk, void *data)
+{
+	struct decode_task *task = data;
+	size_t end = (chunk + 1) * DECODE_CHUNK;
+	if (end > task->parsed->length)
+		end = task->parsed->length;
+
+	struct bit_reader reader = {
+		.data = task->data,
+		.length = task->length,
+		.flags = task->parsed->flags,
+		.order = task->parsed->order,
+	};
+	struct arena *arena = &task->parsed->arenas[chunk];
+	for (size_t i = chunk * DECODE_CHUNK; i < end; i++) {
+		reader.bit = task->offsets[i];
+		task->parsed->entries[i] =
+			parse_bloc_bblc(&reader, arena, 0);
+	}
+}
+
+// the entries reachable from the final one are decoded level by level, each
+// level is split into tasks with their own arena and list of references
+#define REACH_TASKS_PER_THREAD 4
+struct reach_level {
+	struct bloc_parsed *parsed;
+	const size_t *entries;
+	size_t length;
+	size_t count; // of tasks
+	struct entry_list *refs; // per task
+};
+
+static void decode_reachable_task(size_t index, void *data)
+{
+	struct reach_level *level = data;
+	struct bloc_parsed *parsed = level->parsed;
+	struct bit_reader reader = {
+		.data = parsed->data,
+		.length = parsed->data_length,
+		.flags = parsed->flags,
+		.order = parsed->order,
+	};
+	const size_t first = index * level->length / level->count;
+	const size_t end = (index + 1) * level->length / level->count;
+	for (size_t i = first; i < end; i++) {
+		const size_t entry = level->entries[i];
+		reader.bit = parsed->offsets[entry];
+		parsed->entries[entry] = parse_bloc_bblc(
+			&reader, &parsed->arenas[index], &level->refs[index]);
+	}
+}
+
+// amount of threads
+extern size_t threads;
+
+// afterwards, bloc_entry doesn't modify the bloc when expanding the final
+// entry, so the expansion can be done by multiple threads
+static void decode_reachable(struct bloc_parsed *parsed)
+{
+	uint8_t *queued = calloc(parsed->length, 1);
+	struct entry_list *refs = calloc(parsed->arena_count, sizeof(*refs));
+	struct entry_list current = { 0 }, next = { 0 };
+	if (!queued || !refs)
+		fatal("out of memory!\n");
+
+	push_entry(&current, parsed->length - 1);
+	queued[parsed->length - 1] = 1;
+	while (current.length) {
+		struct reach_level level = {
+			.parsed = parsed,
+			.entries = current.entries,
+			.length = current.length,
+			.count = parsed->arena_count,
+			.refs = refs,
+		};
+		if (level.count > current.length)
+			level.count = current.length;
+		pool_run(level.count, decode_reachable_task, &level);
+
+		next.length = 0;
+		for (size_t i = 0; i < level.count; i++) {
+			for (size_t j = 0; j < refs[i].length; j++) {
+				const size_t ref = refs[i].entries[j];
+				if (ref + 1 >= parsed->length)
+					fatal("invalid ref index %ld\n", ref);
+				const size_t entry = parsed->length - ref - 2;
+				if (!queued[entry]) {
+					queued[entry] = 1;
+					push_entry(&next, entry);
+				}
+			}
+			refs[i].length = 0;
+		}
+
+		const struct entry_list swap = current;
+		current = next;
+		next = swap;
+	}
+
+	for (size_t i = 0; i < parsed->arena_count; i++)
+		free(refs[i].entries);
+	free(refs);
+	free(current.entries);
+	free(next.entries);
+	free(queued);
+}
+
+struct bloc_parsed *parse_bloc(const void *bloc, size_t length, int lazy)
 {
 	const struct bloc_header *header = bloc;
-	if (memcmp(header->identifier, BLOC_IDENTIFIER,
+	if (length < BLOC_HEADER_LENGTH ||
+	    memcmp(header->identifier, BLOC_IDENTIFIER,
 		   (size_t)BLOC_IDENTIFIER_LENGTH)) {
 		fatal("invalid BLoC identifier!\n");
 		return 0;
 	}
 
+	const uint8_t *data = (const uint8_t *)&header->entries;
+	const uint8_t *end = (const uint8_t *)bloc + length;
+	size_t count = header->length;
+	int flags = 0, order = 0;
+	if (header->length < 0) {
+		fatal("invalid BLoC length!\n");
+	} else if (!header->length) { // extended header
+		const struct bloc_header_v2 *header_v2 = bloc;
+		if (length < BLOC_HEADER_V2_LENGTH ||
+		    header_v2->version != BLOC_VERSION)
+			fatal("unsupported BLoC version!\n");
+		flags = header_v2->flags;
+		if (flags & ~BLOC_FLAGS)
+			fatal("unsupported BLoC flags %x!\n", flags);
+		data = (const uint8_t *)&header_v2->length;
+		if (flags & BLOC_FLAG_VARINT && data < end)
+			order = *data++;
+		count = read_varint(&data, end);
+	}
+
+	uint64_t *offsets = 0;
+	if (flags & BLOC_FLAG_INDEX) {
+		if ((size_t)(end - data) / 8 < count)
+			fatal("invalid BLoC index!\n");
+		offsets = malloc(count * sizeof(*offsets));
+		if (!offsets)
+			fatal("out of memory!\n");
+		for (size_t i = 0; i < count; i++) {
+			offsets[i] = read_u64(data);
+			data += 8;
+		}
+		for (size_t i = 0; i < count; i++)
+			if (offsets[i] / 8 >= (size_t)(end - data))
+				fatal("invalid BLoC index!\n");
+	}
+
 	struct bloc_parsed *parsed = malloc(sizeof(*parsed));
-	parsed->length = header->length;
-	parsed->entries = malloc(header->length * sizeof(struct term *));
+	if (!parsed)
+		fatal("out of memory!\n");
+	parsed->length = count;
+	parsed->entries = calloc(count, sizeof(struct term *));
+	if (!parsed->entries)
+		fatal("out of memory!\n");
+	parsed->data = data;
+	parsed->data_length = end - data;
+	parsed->offsets = 0;
+	parsed->flags = flags;
+	parsed->order = order;
+
+	// entries are decoded in parallel tasks with separate arenas, either
+	// all indexed ones in chunks or the reachable ones of lazy blocs
+	parsed->arena_count = 1;
+	if (offsets && !lazy)
+		parsed->arena_count = (count + DECODE_CHUNK - 1) / DECODE_CHUNK;
+	else if (lazy && threads > 1 && count)
+		parsed->arena_count = threads * REACH_TASKS_PER_THREAD;
+	parsed->arenas = malloc(parsed->arena_count * sizeof(struct arena));
+	if (!parsed->arenas)
+		fatal("out of memory!\n");
+	for (size_t i = 0; i < parsed->arena_count; i++)
+		arena_init(&parsed->arenas[i]);
+
+	if (lazy) {
+		if (!offsets) { // find the padded entries without decoding
+			offsets = malloc(count * sizeof(*offsets));
+			if (!offsets)
+				fatal("out of memory!\n");
+			struct bit_reader reader = {
+				.data = data,
+				.length = end - data,
+				.bit = 0,
+				.flags = flags,
+				.order = order,
+			};
+			for (size_t i = 0; i < count; i++) {
+				offsets[i] = reader.bit;
+				if (!skip_bloc_bblc(&reader))
+					fatal("invalid BLoC entry %lu!\n", i);
+				align_entry(&reader);
+			}
+		}
+		parsed->offsets = offsets;
+		if (parsed->arena_count > 1)
+			decode_reachable(parsed);
+		return parsed;
+	}
+
+	if (offsets) {
+		struct decode_task task = {
+			.parsed = parsed,
+			.data = data,
+			.length = end - data,
+			.offsets = offsets,
+		};
+		pool_run(parsed->arena_count, decode_entries, &task);
+		free(offsets);
+		return parsed;
+	}
 
-	const struct bloc_entry *current = (const void *)&header->entries;
+	struct bit_reader reader = {
+		.data = data,
+		.length = end - data,
+		.bit = 0,
+		.flags = flags,
+		.order = order,
+	};
 	for (size_t i = 0; i < parsed->length; i++) {
-		size_t len = 0;
 		parsed->entries[i] =
-			parse_bloc_bblc((const char *)current, &len);
-		current =
-			(const struct bloc_entry *)(((const char *)current) +
-						    (len / 8) + (len % 8 != 0));
+			parse_bloc_bblc(&reader, parsed->arenas, 0);
+		align_entry(&reader);
 	}
 
 	return parsed;
 }
 
-void free_bloc(struct bloc_parsed *bloc)
+// decodes the entry on first access, only thread-safe for entries that are
+// already decoded
+struct term *bloc_entry(struct bloc_parsed *bloc, size_t index)
 {
-	for (size_t i = 0; i < bloc->length; i++) {
-		free_term(bloc->entries[i]);
+	if (index >= bloc->length)
+		fatal("invalid entry index %lu\n", index);
+	if (!bloc->entries[index]) {
+		struct bit_reader reader = {
+			.data = bloc->data,
+			.length = bloc->data_length,
+			.bit = bloc->offsets[index],
+			.flags = bloc->flags,
+			.order = bloc->order,
+		};
+		bloc->entries[index] =
+			parse_bloc_bblc(&reader, bloc->arenas, 0);
 	}
+	return bloc->entries[index];
+}
+
+void free_bloc(struct bloc_parsed *bloc)
+{
+	for (size_t i = 0; i < bloc->arena_count; i++)
+		arena_destroy(&bloc->arenas[i]);
 
+	free(bloc->arenas);
+	free(bloc->offsets);
 	free(bloc->entries);
 	free(bloc);
 }
@@ -0,0 +1,58 @@
+// Copyright (c) 2023, Marvin Borner <dev@marvinborner.de>
+// SPDX-License-Identifier: MIT
+
+// minimal worker pool: the tasks of a run are distributed dynamically, every
+// thread grabs the next unclaimed index until all of them are done
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#include <log.h>
+#include <pool.h>
+
+struct pool_run {
+	size_t count;
+	size_t next; // next unclaimed task
+	pool_task_f task;
+	void *data;
+};
+
+static void *worker(void *arg)
+{
+	struct pool_run *run = arg;
+	size_t index;
+	while ((index = __atomic_fetch_add(&run->next, 1, __ATOMIC_RELAXED)) <
+	       run->count)
+		run->task(index, run->data);
+	return 0;
+}
+
+// runs task(index, data) for every index below count using all threads
+extern size_t threads;
+void pool_run(size_t count, pool_task_f task, void *data)
+{
+	struct pool_run run = {
+		.count = count,
+		.next = 0,
+		.task = task,
+		.data = data,
+	};
+
+	size_t workers = threads < count ? threads : count;
+	if (workers <= 1) {
+		worker(&run);
+		return;
+	}
+
+	// the calling thread is a worker as well
+	pthread_t *ids = malloc((workers - 1) * sizeof(*ids));
+	if (!ids)
+		fatal("out of memory!\n");
+	for (size_t i = 0; i < workers - 1; i++)
+		if (pthread_create(&ids[i], 0, worker, &run))
+			fatal("can't create thread\n");
+	worker(&run);
+	for (size_t i = 0; i < workers - 1; i++)
+		pthread_join(ids[i], 0);
+	free(ids);
+}
@@ -2,56 +2,112 @@
 // SPDX-License-Identifier: MIT
 
 #include <stdio.h>
+#include <stdlib.h>
 
 #include <print.h>
 #include <log.h>
 
+// an item is either a term or a token that follows its subterms
+struct print_item {
+	struct term *term;
+	char token;
+};
+
+static void push_item(struct print_item **stack, size_t *depth,
+		      size_t *capacity, struct term *term, char token)
+{
+	if (*depth == *capacity) {
+		*capacity *= 2;
+		*stack = realloc(*stack, *capacity * sizeof(**stack));
+		if (!*stack)
+			fatal("out of memory!\n");
+	}
+	(*stack)[(*depth)++] = (struct print_item){ term, token };
+}
+
+// uses an explicit stack, as terms can be arbitrarily deep
 void print_bruijn(struct term *term)
 {
-	switch (term->type) {
-	case ABS:
-		fprintf(stderr, "[");
-		print_bruijn(term->u.abs.term);
-		fprintf(stderr, "]");
-		break;
-	case APP:
-		fprintf(stderr, "(");
-		print_bruijn(term->u.app.lhs);
-		fprintf(stderr, " ");
-		print_bruijn(term->u.app.rhs);
-		fprintf(stderr, ")");
-		break;
-	case VAR:
-		fprintf(stderr, "%d", term->u.var.index);
-		break;
-	case REF:
-		fprintf(stderr, "<%ld>", term->u.ref.index);
-		break;
-	default:
-		fatal("invalid type %d\n", term->type);
+	size_t depth = 0, capacity = 64;
+	struct print_item *stack = malloc(capacity * sizeof(*stack));
+	if (!stack)
+		fatal("out of memory!\n");
+
+	push_item(&stack, &depth, &capacity, term, 0);
+	while (depth) {
+		const struct print_item item = stack[--depth];
+		term = item.term;
+		if (!term) {
+			fputc(item.token, stderr);
+			continue;
+		}
+
+		switch (term->type) {
+		case ABS:
+			fprintf(stderr, "[");
+			push_item(&stack, &depth, &capacity, 0, ']');
+			push_item(&stack, &depth, &capacity, term->u.abs.term,
+				  0);
+			break;
+		case APP:
+			fprintf(stderr, "(");
+			push_item(&stack, &depth, &capacity, 0, ')');
+			push_item(&stack, &depth, &capacity, term->u.app.rhs,
+				  0);
+			push_item(&stack, &depth, &capacity, 0, ' ');
+			push_item(&stack, &depth, &capacity, term->u.app.lhs,
+				  0);
+			break;
+		case VAR:
+			fprintf(stderr, "%d", term->u.var.index);
+			break;
+		case REF:
+			if (term->u.ref.shift)
+				fprintf(stderr, "<%ld+%ld>", term->u.ref.index,
+					term->u.ref.shift);
+			else
+				fprintf(stderr, "<%ld>", term->u.ref.index);
+			break;
+		default:
+			fatal("invalid type %d\n", term->type);
+		}
 	}
+	free(stack);
 }
 
 void print_blc(struct term *term)
 {
-	switch (term->type) {
-	case ABS:
-		printf("00");
-		print_blc(term->u.abs.term);
-		break;
-	case APP:
-		printf("01");
-		print_blc(term->u.app.lhs);
-		print_blc(term->u.app.rhs);
-		break;
-	case VAR:
-		for (int i = 0; i <= term->u.var.index; i++)
-			printf("1");
-		printf("0");
-		break;
-	default:
-		fatal("invalid type %d\n", term->type);
+	size_t depth = 0, capacity = 64;
+	struct print_item *stack = malloc(capacity * sizeof(*stack));
+	if (!stack)
+		fatal("out of memory!\n");
+
+	push_item(&stack, &depth, &capacity, term, 0);
+	while (depth) {
+		term = stack[--depth].term;
+		switch (term->type) {
+		case ABS:
+			printf("00");
+			push_item(&stack, &depth, &capacity, term->u.abs.term,
+				  0);
+			break;
+		case APP:
+			printf("01");
+			push_item(&stack, &depth, &capacity, term->u.app.rhs,
+				  0);
+			push_item(&stack, &depth, &capacity, term->u.app.lhs,
+				  0);
+			break;
+		case VAR:
+			for (int i = 0; i <= term->u.var.index; i++)
+				printf("1");
+			printf("0");
+			break;
+		default:
+			fatal("invalid type %d\n", term->type);
+		}
 	}
+	free(stack);
 }
 
 void print_bloc(struct bloc_parsed *bloc)
@@ -60,11 +116,11 @@ void print_bloc(struct bloc_parsed *bloc)
 	fprintf(stderr, "| entries:\t%ld\n", bloc->length);
 	for (size_t i = 0; i < bloc->length - 1; i++) {
 		fprintf(stderr, "| entry %ld:\t", bloc->length - i - 2);
-		print_bruijn(bloc->entries[i]);
+		print_bruijn(bloc_entry(bloc, i));
 		fprintf(stderr, "\n");
 	}
 	fprintf(stderr, "| final:\t");
-	print_bruijn(bloc->entries[bloc->length - 1]);
+	print_bruijn(bloc_entry(bloc, bloc->length - 1));
 	fprintf(stderr, "\n");
 	fprintf(stderr, "=== END BLOC ===\n\n");
 }
@@ -0,0 +1,392 @@
+// Copyright (c) 2023, Marvin Borner <dev@marvinborner.de>
+// SPDX-License-Identifier: MIT
+
+// optional normalization before the deduplication
+// subterms get eta- and beta-reduced within a budget, but a reduction is
+// only kept if it makes the subterm shorter (fully reduced expressions
+// aren't necessarily shorter, so the shortest intermediate form wins)
+// subterms that occur multiple times in the input get replaced by a
+// reference anyway, so they only count as such -- otherwise reducing would
+// inline shared functions into every application
+
+#include <stdlib.h>
+
+#include <log.h>
+#include <map.h>
+#include <reduce.h>
+
+// only subterms up to this blc length (in bits) get reduced, which also
+// bounds the recursion depth of the helpers below
+#define REDUCE_MAX_BITS (1 << 12)
+
+// intermediate terms may grow up to this blc length
+#define REDUCE_MAX_GROWTH (1 << 14)
+
+// maximum amount of reductions per subterm
+#define REDUCE_STEPS 64
+
+// rough blc length of a reference to a shared subterm, smaller subterms
+// never count as shared
+#define REDUCE_REF_BITS 16
+
+static hash_t hash_term(term_type type, hash_t lhs, hash_t rhs)
+{
+	hash_t res = hash((const uint8_t *)&type, sizeof(type), lhs);
+	if (type == APP)
+		return hash((const uint8_t *)&res, sizeof(res), rhs);
+	return res;
+}
+
+// blc length and hash of a term
+struct measure {
+	size_t bits;
+	hash_t hash;
+};
+
+static struct measure measure_node(struct term *term, struct measure *lhs,
+				   struct measure *rhs)
+{
+	switch (term->type) {
+	case ABS:
+		return (struct measure){ 2 + lhs->bits,
+					 hash_term(ABS, lhs->hash, 0) };
+	case APP:
+		return (struct measure){ 2 + lhs->bits + rhs->bits,
+					 hash_term(APP, lhs->hash, rhs->hash) };
+	case VAR:
+		return (struct measure){ term->u.var.index + 2,
+					 hash_term(VAR, term->u.var.index,
+						   0) };
+	default:
+		fatal("invalid type %d\n", term->type);
+	}
+	return (struct measure){ 0, 0 };
+}
+
+static int is_shared(struct map *counts, struct measure *measure)
+{
+	if (measure->bits <= REDUCE_REF_BITS)
+		return 0;
+	uint32_t *count = map_find(counts, measure->hash);
+	return count && *count > 1;
+}
+
+// estimated length of the term after the deduplication, shared subterms
+// (but not the term itself) cost a reference
+static size_t term_cost(struct map *counts, struct term *term,
+			struct measure *res)
+{
+	struct measure lhs, rhs;
+	size_t cost = 2;
+	switch (term->type) {
+	case ABS:
+		cost += term_cost(counts, term->u.abs.term, &lhs);
+		if (is_shared(counts, &lhs))
+			cost = 2 + REDUCE_REF_BITS;
+		break;
+	case APP:;
+		size_t left = term_cost(counts, term->u.app.lhs, &lhs);
+		size_t right = term_cost(counts, term->u.app.rhs, &rhs);
+		cost += is_shared(counts, &lhs) ? REDUCE_REF_BITS : left;
+		cost += is_shared(counts, &rhs) ? REDUCE_REF_BITS : right;
+		break;
+	case VAR:
+		cost += term->u.var.index;
+		break;
+	default:
+		fatal("invalid type %d\n", term->type);
+	}
+	*res = measure_node(term, &lhs, &rhs);
+	return cost;
+}
+
+static struct term *new_abs(struct arena *arena, struct term *body)
+{
+	struct term *res = new_term(arena, ABS);
+	res->u.abs.term = body;
+	return res;
+}
+
+static struct term *new_app(struct arena *arena, struct term *lhs,
+			    struct term *rhs)
+{
+	struct term *res = new_term(arena, APP);
+	res->u.app.lhs = lhs;
+	res->u.app.rhs = rhs;
+	return res;
+}
+
+static struct term *new_var(struct arena *arena, int index)
+{
+	struct term *res = new_term(arena, VAR);
+	res->u.var.index = index;
+	return res;
+}
+
+// copies a term while shifting its free indices (those >= cutoff)
+static struct term *shift_term(struct arena *arena, struct term *term,
+			       int amount, int cutoff)
+{
+	switch (term->type) {
+	case ABS:
+		return new_abs(arena, shift_term(arena, term->u.abs.term,
+						 amount, cutoff + 1));
+	case APP:
+		return new_app(arena,
+			       shift_term(arena, term->u.app.lhs, amount,
+					  cutoff),
+			       shift_term(arena, term->u.app.rhs, amount,
+					  cutoff));
+	case VAR:
+		if (term->u.var.index < cutoff)
+			return new_var(arena, term->u.var.index);
+		return new_var(arena, term->u.var.index + amount);
+	default:
+		fatal("invalid type %d\n", term->type);
+	}
+	return 0;
+}
+
+// replaces the index depth with the value (whose free indices are shifted
+// under the binders above it), the indices above it lose a binder
+static struct term *substitute(struct arena *arena, struct term *term,
+			       struct term *value, int depth)
+{
+	switch (term->type) {
+	case ABS:
+		return new_abs(arena, substitute(arena, term->u.abs.term,
+						 value, depth + 1));
+	case APP:
+		return new_app(arena,
+			       substitute(arena, term->u.app.lhs, value, depth),
+			       substitute(arena, term->u.app.rhs, value,
+					  depth));
+	case VAR:
+		if (term->u.var.index == depth)
+			return shift_term(arena, value, depth, 0);
+		if (term->u.var.index > depth)
+			return new_var(arena, term->u.var.index - 1);
+		return term;
+	default:
+		fatal("invalid type %d\n", term->type);
+	}
+	return 0;
+}
+
+static int has_index(struct term *term, int depth)
+{
+	switch (term->type) {
+	case ABS:
+		return has_index(term->u.abs.term, depth + 1);
+	case APP:
+		return has_index(term->u.app.lhs, depth) ||
+		       has_index(term->u.app.rhs, depth);
+	case VAR:
+		return term->u.var.index == depth;
+	default:
+		fatal("invalid type %d\n", term->type);
+	}
+	return 0;
+}
+
+// contracts the leftmost outermost beta or eta redex, the unchanged parts
+// are shared with the original term
+static struct term *step(struct arena *arena, struct term *term, int *reduced)
+{
+	struct term *res;
+	switch (term->type) {
+	case ABS:;
+		struct term *body = term->u.abs.term;
+		if (body->type == APP && body->u.app.rhs->type == VAR &&
+		    !body->u.app.rhs->u.var.index &&
+		    !has_index(body->u.app.lhs, 0)) {
+			*reduced = 1;
+			return shift_term(arena, body->u.app.lhs, -1, 0);
+		}
+		res = step(arena, body, reduced);
+		return *reduced ? new_abs(arena, res) : term;
+	case APP:
+		if (term->u.app.lhs->type == ABS) {
+			*reduced = 1;
+			return substitute(arena, term->u.app.lhs->u.abs.term,
+					  term->u.app.rhs, 0);
+		}
+		res = step(arena, term->u.app.lhs, reduced);
+		if (*reduced)
+			return new_app(arena, res, term->u.app.rhs);
+		res = step(arena, term->u.app.rhs, reduced);
+		return *reduced ? new_app(arena, term->u.app.lhs, res) : term;
+	case VAR:
+		return term;
+	default:
+		fatal("invalid type %d\n", term->type);
+	}
+	return 0;
+}
+
+// returns the cheapest form found within the budget, or the term itself
+static struct term *reduce_subterm(struct arena *arena, struct map *counts,
+				   struct term *term)
+{
+	struct measure measure;
+	struct term *best = term;
+	size_t cost = term_cost(counts, term, &measure);
+	for (int i = 0; i < REDUCE_STEPS; i++) {
+		int reduced = 0;
+		term = step(arena, term, &reduced);
+		if (!reduced)
+			break;
+
+		size_t length = term_cost(counts, term, &measure);
+		if (measure.bits > REDUCE_MAX_GROWTH)
+			break;
+		if (length < cost) {
+			best = term;
+			cost = length;
+		}
+	}
+	return best;
+}
+
+// whether the term is a beta redex (or the top of an application spine
+// with an abstraction as head) or an eta redex
+static int is_reducible(struct term *term)
+{
+	if (term->type == ABS) {
+		struct term *body = term->u.abs.term;
+		return body->type == APP && body->u.app.rhs->type == VAR &&
+		       !body->u.app.rhs->u.var.index;
+	}
+
+	int arguments = 0;
+	while (term->type == APP) {
+		term = term->u.app.lhs;
+		arguments++;
+	}
+	return arguments && term->type == ABS;
+}
+
+// post-order traversal using an explicit stack, either counting the
+// subterms or reducing them bottom-up
+struct reduce_frame {
+	struct term *term;
+	char post; // subterms are done
+	char spine; // lhs of an application
+};
+
+// result of reducing a subterm, 0 if it was kept
+struct reduced {
+	struct term *term;
+	struct measure measure;
+};
+
+// the attempts are discarded, only the result is kept
+static struct term *reduce(struct arena *arena, struct map *counts,
+			   struct term *term)
+{
+	struct arena scratch;
+	arena_init(&scratch);
+	struct term *res = reduce_subterm(&scratch, counts, term);
+	res = res == term ? 0 : shift_term(arena, res, 0, 0);
+	arena_destroy(&scratch);
+	return res;
+}
+
+static size_t traverse(struct term *term, struct map *counts,
+		       struct map *results, struct arena *arena)
+{
+	size_t depth = 0, capacity = 64;
+	struct reduce_frame *stack = malloc(capacity * sizeof(*stack));
+	size_t measured = 0; // every complete subterm
+	struct measure *measures = malloc(capacity * sizeof(*measures));
+	if (!stack || !measures)
+		fatal("out of memory!\n");
+
+	size_t reductions = 0;
+	stack[depth++] = (struct reduce_frame){ term, 0, 0 };
+	while (depth) {
+		const struct reduce_frame frame = stack[--depth];
+		term = frame.term;
+		if (depth + 3 > capacity) {
+			capacity *= 2;
+			stack = realloc(stack, capacity * sizeof(*stack));
+			measures =
+				realloc(measures, capacity * sizeof(*measures));
+			if (!stack || !measures)
+				fatal("out of memory!\n");
+		}
+
+		if (!frame.post) {
+			stack[depth++] =
+				(struct reduce_frame){ term, 1, frame.spine };
+			if (term->type == ABS) {
+				stack[depth++] = (struct reduce_frame){
+					term->u.abs.term, 0, 0
+				};
+			} else if (term->type == APP) {
+				stack[depth++] = (struct reduce_frame){
+					term->u.app.rhs, 0, 0
+				};
+				stack[depth++] = (struct reduce_frame){
+					term->u.app.lhs, 0, 1
+				};
+			}
+			continue;
+		}
+
+		struct measure lhs, rhs;
+		if (term->type == ABS) {
+			lhs = measures[--measured];
+		} else if (term->type == APP) {
+			rhs = measures[--measured];
+			lhs = measures[--measured];
+		}
+		struct measure measure = measure_node(term, &lhs, &rhs);
+
+		if (!arena) {
+			int found;
+			if (measure.bits > REDUCE_REF_BITS) {
+				uint32_t *count =
+					map_insert(counts, measure.hash, &found);
+				*count = found ? *count + 1 : 1;
+			}
+		} else if (!frame.spine && measure.bits <= REDUCE_MAX_BITS &&
+			   is_reducible(term)) {
+			// identical subterms are reduced identically
+			int found;
+			struct reduced *cached =
+				map_insert(results, measure.hash, &found);
+			if (!found) {
+				cached->term = reduce(arena, counts, term);
+				if (cached->term)
+					term_cost(counts, cached->term,
+						  &cached->measure);
+			}
+			if (cached->term) {
+				*term = *cached->term;
+				measure = cached->measure;
+				reductions++;
+			}
+		}
+		measures[measured++] = measure;
+	}
+
+	free(stack);
+	free(measures);
+	return reductions;
+}
+
+// reduces the term in place, new subterms are allocated in the arena
+void reduce_term(struct term *term, struct arena *arena)
+{
+	struct map counts;
+	map_init(&counts, sizeof(uint32_t), 0);
+	traverse(term, &counts, 0, 0);
+
+	struct map results;
+	map_init(&results, sizeof(struct reduced), 0);
+	debug("reduced %lu subterms\n",
+	      traverse(term, &counts, &results, arena));
+	map_destroy(&results);
+	map_destroy(&counts);
+}
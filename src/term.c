@@ -9,62 +9,60 @@
 #include <print.h>
 #include <log.h>
 
-struct term *new_term(term_type type)
+// terms are freed together with their arena
+struct term *new_term(struct arena *arena, term_type type)
 {
-	struct term *term = malloc(sizeof(*term));
-	if (!term)
-		fatal("out of memory!\n");
+	struct term *term = arena_alloc(arena, sizeof(*term));
 	term->type = type;
 	return term;
 }
 
-void free_term(struct term *term)
-{
-	switch (term->type) {
-	case ABS:
-		free_term(term->u.abs.term);
-		free(term);
-		break;
-	case APP:
-		free_term(term->u.app.lhs);
-		free_term(term->u.app.rhs);
-		free(term);
-		break;
-	case VAR:
-		free(term);
-		break;
-	case REF:
-		free(term);
-		break;
-	default:
-		fatal("invalid type %d\n", term->type);
-	}
-}
-
+// compares both terms pairwise using an explicit stack
 void diff_term(struct term *a, struct term *b)
 {
-	if (a->type != b->type) {
-		fprintf(stderr, "Term a: ");
-		print_bruijn(a);
-		fprintf(stderr, "\nTerm b: ");
-		print_bruijn(b);
-		fatal("\ntype mismatch %d %d\n", a->type, b->type);
-	}
+	size_t depth = 0, capacity = 64;
+	struct term **stack = malloc(capacity * 2 * sizeof(*stack));
+	if (!stack)
+		fatal("out of memory!\n");
+
+	stack[depth++] = a;
+	stack[depth++] = b;
+	while (depth) {
+		b = stack[--depth];
+		a = stack[--depth];
+		if (a->type != b->type) {
+			fprintf(stderr, "Term a: ");
+			print_bruijn(a);
+			fprintf(stderr, "\nTerm b: ");
+			print_bruijn(b);
+			fatal("\ntype mismatch %d %d\n", a->type, b->type);
+		}
+		if (depth + 4 > capacity * 2) {
+			capacity *= 2;
+			stack = realloc(stack, capacity * 2 * sizeof(*stack));
+			if (!stack)
+				fatal("out of memory!\n");
+		}
 
-	switch (a->type) {
-	case ABS:
-		diff_term(a->u.abs.term, b->u.abs.term);
-		break;
-	case APP:
-		diff_term(a->u.app.lhs, b->u.app.lhs);
-		diff_term(a->u.app.rhs, b->u.app.rhs);
-		break;
-	case VAR:
-		if (a->u.var.index != b->u.var.index)
-			fatal("var mismatch %d=%d\n", a->u.var.index,
-			      b->u.var.index);
-		break;
-	default:
-		fatal("invalid type %d\n", a->type);
+		switch (a->type) {
+		case ABS:
+			stack[depth++] = a->u.abs.term;
+			stack[depth++] = b->u.abs.term;
+			break;
+		case APP:
+			stack[depth++] = a->u.app.rhs;
+			stack[depth++] = b->u.app.rhs;
+			stack[depth++] = a->u.app.lhs;
+			stack[depth++] = b->u.app.lhs;
+			break;
+		case VAR:
+			if (a->u.var.index != b->u.var.index)
+				fatal("var mismatch %d=%d\n", a->u.var.index,
+				      b->u.var.index);
+			break;
+		default:
+			fatal("invalid type %d\n", a->type);
+		}
 	}
+	free(stack);
 }
@@ -6,322 +6,1147 @@
 // and finding the largest repeating subtrees.
 
 #include <stdio.h>
-#include <search.h>
 #include <string.h>
 #include <stdlib.h>
 
 #include <log.h>
-#include <pqueue.h>
+#include <map.h>
+#include <pool.h>
 #include <tree.h>
 #include <hash.h>
+#include <build.h>
 
-static struct list *list_end = 0;
-struct list *list_add(struct list *list, void *data)
-{
-	struct list *new = malloc(sizeof(*new));
-	if (!new)
-		fatal("out of memory!\n");
-	new->next = list;
-	new->data = data;
-	new->val = list ? list->val + 1 : 1; // amount of trees in list
-	return new;
-}
+// marks a tree that's selected for sharing but not yet cloned
+#define INVALIDATED_TREE (TREE_NONE - 1)
 
-// element of the tsearch tree
+// value of the candidate map, a list of trees with equal hashes
 struct hash_to_list {
-	hash_t hash;
-	struct list *list;
+	uint32_t head; // latest tree, the others are linked using next
+	uint32_t tail; // earliest tree
+	uint32_t length;
 };
 
-// element of the tsearch tree
-struct hash_to_tree {
-	hash_t hash;
-	struct tree *tree;
+// binder level of free indices, an index i under d binders has level d-i
+// and is free in every subtree that's under at most d-i binders
+struct free_level {
+	long level;
+	uint64_t weight; // sum of the indices' weights, see struct shifted
 };
 
-// comparison_fn_t for tsearch
-static int hash_compare(const void *_a, const void *_b)
+// state needed while building and deduplicating the tree
+// when hash-consing, set maps to the unique trees and next chains trees
+// with colliding hashes, the other columns are unused
+struct builder {
+	struct map set; // hash -> candidate list
+	uint32_t *next; // next tree in candidate list
+	uint32_t *first; // first tree of every subtree (in post-order)
+
+	// sorted free levels of the complete subtrees on the building stack,
+	// only if sharing shifted trees
+	struct free_level *levels;
+	size_t levels_length;
+	size_t levels_capacity;
+	struct free_level *merged; // buffer for merging two subtrees' levels
+	size_t merged_capacity;
+};
+
+// identical subtrees are shared while building
+extern int hash_consing;
+
+// subtrees that only differ by a shift of their free indices are shared
+extern int shift_sharing;
+
+// references are written using a variable-width code
+extern int varint_refs;
+
+static void grow_tree(struct tree *tree, struct builder *builder)
 {
-	const struct hash_to_list *a = _a;
-	const struct hash_to_list *b = _b;
+	if (tree->length < tree->capacity)
+		return;
 
-	if (a->hash < b->hash)
-		return -1;
-	if (a->hash > b->hash)
-		return 1;
-	return 0;
+	// indices must not collide with the special states
+	if (tree->capacity >= INVALIDATED_TREE)
+		fatal("term too large!\n");
+	tree->capacity = tree->capacity ? tree->capacity * 2 : 1 << 10;
+	if (tree->capacity > INVALIDATED_TREE)
+		tree->capacity = INVALIDATED_TREE;
+
+	size_t n = tree->capacity;
+	tree->type = realloc(tree->type, n * sizeof(*tree->type));
+	tree->lhs = realloc(tree->lhs, n * sizeof(*tree->lhs));
+	tree->rhs = realloc(tree->rhs, n * sizeof(*tree->rhs));
+	tree->hash = realloc(tree->hash, n * sizeof(*tree->hash));
+	tree->size = realloc(tree->size, n * sizeof(*tree->size));
+	tree->ref = realloc(tree->ref, n * sizeof(*tree->ref));
+	builder->next = realloc(builder->next, n * sizeof(*builder->next));
+	if (!tree->type || !tree->lhs || !tree->rhs || !tree->hash ||
+	    !tree->size || !tree->ref || !builder->next)
+		fatal("out of memory!\n");
+	if (shift_sharing) {
+		tree->shift = realloc(tree->shift, n * sizeof(*tree->shift));
+		if (!tree->shift)
+			fatal("out of memory!\n");
+	}
+	if (hash_consing)
+		return;
+
+	builder->first = realloc(builder->first, n * sizeof(*builder->first));
+	if (!builder->first)
+		fatal("out of memory!\n");
 }
 
-// applies the hash function to the tree's elements (similar to merkle trees)
-// also creates a set of lists with deduplication candidates
-// TODO: as above: rethink hash choice
-extern size_t min_size;
-static struct tree *build_tree(struct term *term, void **set)
+static uint32_t add_size(uint32_t a, uint32_t b)
 {
-	struct tree *tree = malloc(sizeof(*tree));
-	if (!tree)
-		fatal("out of memory!\n");
-	tree->type = term->type;
-	tree->state = VALIDATED_TREE;
-	tree->duplication_count = 1;
+	if (a > UINT32_MAX - b)
+		fatal("term too large!\n");
+	return a + b;
+}
 
-	switch (term->type) {
+// applies the hash function to the elements (similar to merkle trees)
+// TODO: as above: rethink hash choice
+static hash_t hash_node(term_type type, hash_t lhs, hash_t rhs)
+{
+	hash_t res;
+	switch (type) {
 	case ABS:
-		tree->u.abs.term = build_tree(term->u.abs.term, set);
-		tree->hash = hash((const uint8_t *)&tree->type,
-				  sizeof(tree->type), tree->u.abs.term->hash);
-		tree->size = tree->u.abs.term->size + 2;
-		break;
+		return hash((const uint8_t *)&type, sizeof(type), lhs);
 	case APP:
-		tree->u.app.lhs = build_tree(term->u.app.lhs, set);
-		tree->u.app.rhs = build_tree(term->u.app.rhs, set);
-		tree->hash = hash((const uint8_t *)&tree->type,
-				  sizeof(tree->type), tree->u.app.lhs->hash);
-		tree->hash = hash((const uint8_t *)&tree->hash,
-				  sizeof(tree->hash), tree->u.app.rhs->hash);
-		tree->size = tree->u.app.lhs->size + tree->u.app.rhs->size + 3;
-		break;
+		res = hash((const uint8_t *)&type, sizeof(type), lhs);
+		return hash((const uint8_t *)&res, sizeof(res), rhs);
 	case VAR:
-		tree->u.var.index = term->u.var.index;
-		tree->hash = hash((const uint8_t *)&tree->type,
-				  sizeof(tree->type), tree->u.var.index);
-		tree->size = term->u.var.index;
-		break;
+		return hash((const uint8_t *)&type, sizeof(type), lhs);
 	default:
-		fatal("invalid type %d\n", term->type);
+		fatal("invalid type %d\n", type);
 	}
+	return 0;
+}
 
-	if (tree->size < min_size) // not suitable for deduplication
-		return tree;
+static hash_t hash_tree(struct tree *tree, term_type type, uint32_t lhs,
+			uint32_t rhs)
+{
+	if (type == VAR)
+		return hash_node(type, lhs, 0);
+	return hash_node(type, tree->hash[lhs],
+			 type == APP ? tree->hash[rhs] : 0);
+}
 
-	struct hash_to_list *element = malloc(sizeof(*element));
-	if (!element)
-		fatal("out of memory!\n");
-	element->hash = tree->hash;
+// appends a tree whose subtrees are already complete
+static uint32_t new_tree(struct tree *tree, struct builder *builder,
+			 term_type type, uint32_t lhs, uint32_t rhs, hash_t h)
+{
+	grow_tree(tree, builder);
+	const uint32_t i = tree->length++;
+	tree->type[i] = type;
+	tree->lhs[i] = lhs;
+	tree->rhs[i] = rhs;
+	tree->hash[i] = h;
+	tree->ref[i] = TREE_NONE;
 
-	struct hash_to_list **handle = tsearch(element, set, hash_compare);
-	if (*handle == element) { // first of its kind
-		element->list = list_add(list_end, tree);
-		return tree;
+	if (type == ABS)
+		tree->size[i] = add_size(tree->size[lhs], 2);
+	else if (type == APP)
+		tree->size[i] = add_size(
+			add_size(tree->size[lhs], tree->size[rhs]), 3);
+	else
+		tree->size[i] = lhs;
+	return i;
+}
+
+// appends a tree, it gets hashed later in hash_trees
+extern size_t min_size;
+static uint32_t append_tree(struct tree *tree, struct builder *builder,
+			    term_type type, uint32_t lhs, uint32_t rhs)
+{
+	const uint32_t i = new_tree(tree, builder, type, lhs, rhs, 0);
+	builder->first[i] = type == VAR ? i : builder->first[lhs];
+	return i;
+}
+
+// adds a hashed tree to a set of lists with deduplication candidates
+// the lists are sorted by descending index
+static void add_candidate(struct tree *tree, uint32_t *next, struct map *set,
+			  uint32_t i)
+{
+	if (tree->size[i] < min_size) // not suitable for deduplication
+		return;
+
+	int found;
+	struct hash_to_list *element = map_insert(set, tree->hash[i], &found);
+	if (!found) { // first of its kind
+		element->head = i;
+		element->tail = i;
+		element->length = 1;
+		next[i] = TREE_NONE;
+		return;
 	}
 
-	free(element); // already exists, not needed
-	(*handle)->list = list_add((*handle)->list, tree);
+	element->length++;
+	if (element->head < i) { // usual case, trees are added in order
+		next[i] = element->head;
+		element->head = i;
+		return;
+	}
 
-	return tree;
+	uint32_t list = element->head;
+	while (next[list] != TREE_NONE && next[list] > i)
+		list = next[list];
+	next[i] = next[list];
+	next[list] = i;
+	if (next[i] == TREE_NONE)
+		element->tail = i;
 }
 
-static struct tree *clone_tree_root(struct tree *tree)
+// the trees are hashed in blocks of consecutive indices, a block's trees
+// whose subtrees begin in an earlier block are hashed after all blocks
+// and inserted into the merged lists
+#define HASH_BLOCK (1 << 16)
+struct hash_task {
+	struct tree *tree;
+	struct builder *builder;
+	struct map *sets; // candidates of every block
+	size_t *deferred; // trees of every block that are hashed later
+};
+
+static void hash_block(size_t block, void *data)
 {
-	struct tree *new = malloc(sizeof(*new));
-	if (!new)
+	struct hash_task *task = data;
+	struct tree *tree = task->tree;
+	const uint32_t *first = task->builder->first;
+	const size_t start = block * HASH_BLOCK;
+	size_t end = start + HASH_BLOCK;
+	if (end > tree->length)
+		end = tree->length;
+
+	struct map *set = &task->sets[block];
+	map_init(set, sizeof(struct hash_to_list), 0);
+	task->deferred[block] = 0;
+	for (size_t i = start; i < end; i++) {
+		if (first[i] < start) {
+			task->deferred[block]++;
+			continue;
+		}
+		tree->hash[i] = hash_tree(tree, tree->type[i], tree->lhs[i],
+					  tree->rhs[i]);
+		add_candidate(tree, task->builder->next, set, i);
+	}
+}
+
+// hashes all trees (similar to merkle trees) and collects the candidates
+// the blocks are merged in order, so the result doesn't depend on the
+// amount of threads
+static void hash_trees(struct tree *tree, struct builder *builder)
+{
+	const size_t blocks = (tree->length + HASH_BLOCK - 1) / HASH_BLOCK;
+	struct hash_task task = {
+		.tree = tree,
+		.builder = builder,
+		.sets = malloc(blocks * sizeof(*task.sets)),
+		.deferred = malloc(blocks * sizeof(*task.deferred)),
+	};
+	if (!task.sets || !task.deferred)
 		fatal("out of memory!\n");
-	new->type = tree->type;
-	new->hash = tree->hash;
-	new->duplication_count = tree->duplication_count;
+	pool_run(blocks, hash_block, &task);
 
-	switch (tree->type) {
-	case ABS:
-		new->u.abs.term = tree->u.abs.term;
-		break;
-	case APP:
-		new->u.app.lhs = tree->u.app.lhs;
-		new->u.app.rhs = tree->u.app.rhs;
-		break;
-	case VAR:
-		new->u.var.index = tree->u.var.index;
-		break;
-	default:
-		free(new);
-		fatal("invalid type %d\n", tree->type);
+	// the merged lists are at most as many as the blocks' ones together
+	size_t expected = 0;
+	for (size_t block = 0; block < blocks; block++)
+		expected += task.sets[block].length + task.deferred[block];
+	map_init(&builder->set, sizeof(struct hash_to_list), expected);
+
+	for (size_t block = 0; block < blocks; block++) {
+		// prepend the block's lists to the global ones
+		struct map *set = &task.sets[block];
+		size_t position = 0;
+		hash_t key;
+		struct hash_to_list *local;
+		while ((local = map_next(set, &position, &key))) {
+			int found;
+			struct hash_to_list *element =
+				map_insert(&builder->set, key, &found);
+			if (!found) {
+				*element = *local;
+				continue;
+			}
+			builder->next[local->tail] = element->head;
+			element->head = local->head;
+			element->length += local->length;
+		}
+		map_destroy(set);
+
+		const size_t start = block * HASH_BLOCK;
+		size_t end = start + HASH_BLOCK;
+		if (end > tree->length)
+			end = tree->length;
+		for (size_t i = start; i < end; i++) {
+			if (builder->first[i] >= start)
+				continue;
+			tree->hash[i] = hash_tree(tree, tree->type[i],
+						  tree->lhs[i], tree->rhs[i]);
+			add_candidate(tree, builder->next, &builder->set, i);
+		}
+	}
+	free(task.sets);
+	free(task.deferred);
+}
+
+// returns the existing tree if an identical one was already built
+// subtrees are unique as well, so they're compared by index
+static uint32_t intern_tree(struct tree *tree, struct builder *builder,
+			    term_type type, uint32_t lhs, uint32_t rhs)
+{
+	const hash_t h = hash_tree(tree, type, lhs, rhs);
+	int found;
+	uint32_t *head = map_insert(&builder->set, h, &found);
+	if (found) {
+		for (uint32_t i = *head; i != TREE_NONE; i = builder->next[i])
+			if (tree->type[i] == type && tree->lhs[i] == lhs &&
+			    tree->rhs[i] == rhs)
+				return i;
+	} else {
+		*head = TREE_NONE;
 	}
 
-	return new;
+	const uint32_t i = new_tree(tree, builder, type, lhs, rhs, h);
+	builder->next[i] = *head;
+	*head = i;
+	return i;
 }
 
-static void invalidate_tree(struct tree *tree, int duplication_count)
+static uint32_t add_tree(struct tree *tree, struct builder *builder,
+			 term_type type, uint32_t lhs, uint32_t rhs)
 {
-	tree->state = INVALIDATED_TREE;
-	tree->duplication_count = duplication_count;
-	switch (tree->type) {
-	case ABS:
-		invalidate_tree(tree->u.abs.term, duplication_count);
-		break;
-	case APP:
-		invalidate_tree(tree->u.app.lhs, duplication_count);
-		invalidate_tree(tree->u.app.rhs, duplication_count);
-		break;
-	case VAR:
-		break;
-	default:
-		fatal("invalid type %d\n", tree->type);
+	if (hash_consing)
+		return intern_tree(tree, builder, type, lhs, rhs);
+	return append_tree(tree, builder, type, lhs, rhs);
+}
+
+// a shifted tree's hash combines the merkle hash of its shape with a
+// polynomial hash of its indices in pre-order, which is linear in the
+// indices: shifting the free indices down by k subtracts k times the sum of
+// their weights, so trees are hashed as if shifted down as far as possible
+#define SHIFT_BASE 0x9e3779b97f4a7c15ULL
+
+// trees with more distinct free levels are hashed without shifting
+#define MAX_FREE_LEVELS 1024
+
+// hashing state of a complete subtree on the building stack
+struct shifted {
+	hash_t shape;
+	uint64_t indices; // sum of index * SHIFT_BASE^position
+	uint64_t free; // sum of SHIFT_BASE^position of the free indices
+	uint64_t power; // SHIFT_BASE^nodes
+	size_t levels; // start of the free levels on the level stack
+	uint64_t factor; // pending factor of the levels' weights
+	int overflow; // more than MAX_FREE_LEVELS
+};
+
+static void push_level(struct builder *builder, long level, uint64_t weight)
+{
+	if (builder->levels_length == builder->levels_capacity) {
+		size_t n = builder->levels_capacity ?
+				   builder->levels_capacity * 2 :
+				   64;
+		builder->levels =
+			realloc(builder->levels, n * sizeof(*builder->levels));
+		if (!builder->levels)
+			fatal("out of memory!\n");
+		builder->levels_capacity = n;
 	}
+	builder->levels[builder->levels_length++] =
+		(struct free_level){ level, weight };
 }
 
-static void free_tree(struct tree *tree, int ref_only)
+static void shift_var(struct builder *builder, struct shifted *shifted,
+		      uint32_t index, size_t binders)
 {
-	switch (tree->type) {
-	case ABS:
-		free_tree(tree->u.abs.term, ref_only);
-		break;
-	case APP:
-		free_tree(tree->u.app.lhs, ref_only);
-		free_tree(tree->u.app.rhs, ref_only);
-		break;
-	case VAR:
-		break;
-	case REF:
-		break;
-	default:
-		fatal("invalid type %d\n", tree->type);
+	shifted->shape = hash_node(VAR, 0, 0);
+	shifted->indices = index;
+	shifted->free = 1;
+	shifted->power = SHIFT_BASE;
+	shifted->levels = builder->levels_length;
+	shifted->factor = 1;
+	shifted->overflow = 0;
+	push_level(builder, (long)binders - index, 1);
+}
+
+// the indices on the highest level get bound by the abstraction
+static void shift_abs(struct builder *builder, struct shifted *shifted,
+		      size_t binders)
+{
+	shifted->shape = hash_node(ABS, shifted->shape, 0);
+	shifted->indices *= SHIFT_BASE;
+	shifted->power *= SHIFT_BASE;
+
+	const size_t top = builder->levels_length;
+	if (!shifted->overflow && top > shifted->levels &&
+	    builder->levels[top - 1].level == (long)binders + 1) {
+		shifted->free -= builder->levels[top - 1].weight *
+				 shifted->factor;
+		builder->levels_length--;
+	}
+	shifted->free *= SHIFT_BASE;
+	shifted->factor *= SHIFT_BASE;
+}
+
+// merges the adjacent free levels of both subtrees
+static void shift_app(struct builder *builder, const struct shifted *lhs,
+		      struct shifted *rhs)
+{
+	const uint64_t offset = SHIFT_BASE * lhs->power; // of rhs's positions
+	rhs->shape = hash_node(APP, lhs->shape, rhs->shape);
+	rhs->indices = SHIFT_BASE * lhs->indices + offset * rhs->indices;
+	rhs->free = SHIFT_BASE * lhs->free + offset * rhs->free;
+	rhs->power *= SHIFT_BASE * lhs->power;
+	rhs->overflow |= lhs->overflow;
+
+	const struct free_level *levels = builder->levels;
+	size_t a = lhs->levels, b = rhs->levels, length = 0;
+	const size_t a_end = rhs->levels, b_end = builder->levels_length;
+	const size_t n = a_end - a + b_end - b;
+	if (!rhs->overflow && n > builder->merged_capacity) {
+		builder->merged =
+			realloc(builder->merged, n * sizeof(*builder->merged));
+		if (!builder->merged)
+			fatal("out of memory!\n");
+		builder->merged_capacity = n;
+	}
+	const uint64_t a_factor = SHIFT_BASE * lhs->factor;
+	const uint64_t b_factor = offset * rhs->factor;
+	while (!rhs->overflow && (a < a_end || b < b_end)) {
+		struct free_level level;
+		if (b == b_end ||
+		    (a < a_end && levels[a].level < levels[b].level)) {
+			level = levels[a++];
+			level.weight *= a_factor;
+		} else if (a == a_end || levels[b].level < levels[a].level) {
+			level = levels[b++];
+			level.weight *= b_factor;
+		} else {
+			level = levels[a];
+			level.weight = levels[a++].weight * a_factor +
+				       levels[b++].weight * b_factor;
+		}
+		builder->merged[length++] = level;
+	}
+
+	if (length > MAX_FREE_LEVELS)
+		rhs->overflow = 1;
+	builder->levels_length = lhs->levels;
+	rhs->levels = lhs->levels;
+	rhs->factor = 1;
+	if (rhs->overflow)
 		return;
+	memcpy(builder->levels + lhs->levels, builder->merged,
+	       length * sizeof(*builder->merged));
+	builder->levels_length += length;
+}
+
+// hashes a tree as if its free indices were shifted down to the lowest one
+// (or not at all on overflow), the shift gets stored instead
+static void hash_shifted(struct tree *tree, struct builder *builder,
+			 uint32_t i, const struct shifted *shifted,
+			 size_t binders)
+{
+	const size_t top = builder->levels_length;
+	uint32_t shift = 0;
+	if (!shifted->overflow && top > shifted->levels)
+		shift = binders - builder->levels[top - 1].level;
+	const uint64_t indices = shifted->indices - shift * shifted->free;
+	tree->hash[i] = hash((const uint8_t *)&indices, sizeof(indices),
+			     shifted->shape);
+	tree->shift[i] = shift;
+}
+
+// incomplete tree on the building stack
+struct frame {
+	term_type type;
+	uint32_t lhs;
+	struct shifted shifted; // of lhs, only if sharing shifted trees
+};
+
+// builds the merkle tree bottom-up while streaming the blc input
+// every tree gets hashed as soon as its subtrees are complete, so neither
+// the input nor an intermediate term has to exist in full
+static void build_tree(struct blc_stream *stream, struct tree *tree,
+		       struct builder *builder)
+{
+	size_t depth = 0, capacity = 64, binders = 0;
+	struct frame *stack = malloc(capacity * sizeof(*stack));
+	if (!stack)
+		fatal("out of memory!\n");
+
+	while (1) {
+		int index;
+		term_type type = blc_stream_next(stream, &index);
+		if (type == INV)
+			fatal("invalid parsing state!\n");
+
+		if (type != VAR) { // wait for subtrees
+			if (depth == capacity) {
+				capacity *= 2;
+				stack = realloc(stack,
+						capacity * sizeof(*stack));
+				if (!stack)
+					fatal("out of memory!\n");
+			}
+			stack[depth].type = type;
+			stack[depth].lhs = TREE_NONE;
+			depth++;
+			if (type == ABS)
+				binders++;
+			continue;
+		}
+
+		// complete trees bubble up until a parent is still incomplete
+		uint32_t i = add_tree(tree, builder, VAR, index, 0);
+		struct shifted shifted = { 0 };
+		if (shift_sharing) {
+			shift_var(builder, &shifted, index, binders);
+			hash_shifted(tree, builder, i, &shifted, binders);
+		}
+		while (1) {
+			if (!depth) {
+				free(stack);
+				tree->root = i;
+				return;
+			}
+
+			struct frame *parent = &stack[depth - 1];
+			if (parent->type == APP && parent->lhs == TREE_NONE) {
+				parent->lhs = i;
+				parent->shifted = shifted;
+				break;
+			}
+
+			if (parent->type == ABS) {
+				i = add_tree(tree, builder, ABS, i, 0);
+				binders--;
+				if (shift_sharing)
+					shift_abs(builder, &shifted, binders);
+			} else {
+				i = add_tree(tree, builder, APP, parent->lhs,
+					     i);
+				if (shift_sharing)
+					shift_app(builder, &parent->shifted,
+						  &shifted);
+			}
+			if (shift_sharing)
+				hash_shifted(tree, builder, i, &shifted,
+					     binders);
+			depth--;
+		}
 	}
+}
 
-	if (!ref_only || (ref_only && FREEABLE_TREE(tree)))
-		free(tree);
+static void add_saturated(uint32_t *value, uint32_t n)
+{
+	*value = *value > UINT32_MAX - n ? UINT32_MAX : *value + n;
 }
 
-static void ref_invalidated_tree(struct tree *tree)
+// estimated padding of an entry in bits
+#define ENTRY_COST 4
+
+// format flags that affect the length of references
+static int ref_flags(void)
 {
-	switch (tree->type) {
-	case ABS:
-		free_tree(tree->u.abs.term, 1);
-		break;
-	case APP:
-		free_tree(tree->u.app.lhs, 1);
-		free_tree(tree->u.app.rhs, 1);
-		break;
-	case VAR:
-		break;
-	default:
-		fatal("invalid type %d\n", tree->type);
+	return (shift_sharing ? BLOC_FLAG_SHIFT : 0) |
+	       (varint_refs ? BLOC_FLAG_VARINT : 0);
+}
+
+// whether sharing a tree saves bits: every occurrence but the entry itself
+// gets replaced by a reference, whose width depends on the table size
+// shifted references additionally cost the given bits
+static int worth_sharing(uint32_t bits, uint32_t count, size_t entries,
+			 uint64_t shifts)
+{
+	const uint64_t ref = ref_length(entries, ref_flags());
+	return (uint64_t)bits * (count - 1) > ENTRY_COST + ref * count + shifts;
+}
+
+// subtrees of a tree that have a class
+// trees smaller than min_size have none, neither do their subtrees
+static int subtree_classes(struct tree *tree, const uint32_t *class,
+			   uint32_t i, uint32_t subtrees[2])
+{
+	int n = 0;
+	if (tree->type[i] == ABS || tree->type[i] == APP)
+		subtrees[n++] = tree->lhs[i];
+	if (tree->type[i] == APP)
+		subtrees[n++] = tree->rhs[i];
+	for (int j = 0; j < n; j++)
+		subtrees[j] = class ? class[subtrees[j]] : subtrees[j];
+	return n;
+}
+
+// estimates the encoded length of every tree bottom-up, shared subtrees
+// cost a reference (shifted relative to the entry of their class, if any)
+static void estimate_bits(struct tree *tree, const uint32_t *class,
+			  const uint32_t *entry, uint32_t *bits, uint32_t ref)
+{
+	for (size_t i = 0; i < tree->length; i++) {
+		switch (tree->type[i]) {
+		case ABS:
+			bits[i] = 3;
+			break;
+		case APP:
+			bits[i] = 2;
+			break;
+		default:
+			bits[i] = tree->lhs[i] + 2;
+			continue;
+		}
+
+		// subtrees without class are never shared
+		uint32_t subtrees[2];
+		int n = subtree_classes(tree, class, i, subtrees);
+		for (int j = 0; j < n; j++) {
+			uint32_t sub = j ? tree->rhs[i] : tree->lhs[i];
+			const uint32_t shared = subtrees[j];
+			if (shared == TREE_NONE ||
+			    tree->ref[shared] != INVALIDATED_TREE) {
+				add_saturated(&bits[i], bits[sub]);
+				continue;
+			}
+			add_saturated(&bits[i], ref);
+			if (!entry)
+				continue;
+			const uint32_t shift =
+				tree->shift[sub] - tree->shift[entry[shared]];
+			add_saturated(&bits[i], shift_bits(shift, ref_flags()));
+		}
 	}
-	if (tree->state != INVALIDATED_TREE &&
-	    tree->state != VALIDATED_TREE) { // is reffed
-		tree->type = REF;
-		tree->u.ref.hash = tree->state;
-		tree->state = VALIDATED_TREE;
+}
+
+// parents always have larger indices than their subtrees, so walking the
+// representatives backwards visits every class after all of its parents:
+// a class is shared if that saves bits with its current occurrence count,
+// and its subtrees then only occur once per entry instead of once per
+// occurrence
+// the shared representatives are marked as INVALIDATED_TREE
+static size_t mark_shared(struct tree *tree, const uint32_t *class,
+			  const uint32_t *bits, uint32_t *count)
+{
+	size_t entries = 0;
+	memset(count, 0, tree->length * sizeof(*count));
+	count[tree->root] = 1;
+	for (size_t i = tree->length; i-- > 0;) {
+		if (class && class[i] != i)
+			continue;
+
+		uint32_t emit = count[i];
+		if (i != tree->root && count[i] > 1 &&
+		    tree->size[i] >= min_size &&
+		    worth_sharing(bits[i], count[i], entries, 0)) {
+			tree->ref[i] = INVALIDATED_TREE;
+			emit = 1;
+			entries++;
+		}
+
+		uint32_t subtrees[2];
+		int n = subtree_classes(tree, class, i, subtrees);
+		for (int j = 0; j < n; j++)
+			if (subtrees[j] != TREE_NONE)
+				add_saturated(&count[subtrees[j]], emit);
 	}
+	return entries;
 }
 
-// priority of candidate -> length of expression
-// TODO: What about occurrence count (list length)?
-static pqueue_pri_t get_pri(void *a)
+// selects the shared trees, identical trees form a class represented by
+// its earliest tree (or every tree is its own class if hash-consed)
+// the first selection overestimates the length of trees with shared
+// subtrees, so it's repeated with the lengths resulting from it
+static void select_shared(struct tree *tree, const uint32_t *class)
 {
-	return ((struct tree *)((struct list *)a)->data)->size;
+	const size_t length = tree->length;
+	uint32_t *count = malloc(length * sizeof(*count));
+	uint32_t *bits = malloc(length * sizeof(*bits));
+	if (!count || !bits)
+		fatal("out of memory!\n");
+
+	estimate_bits(tree, class, 0, bits, 0);
+	size_t entries = mark_shared(tree, class, bits, count);
+
+	estimate_bits(tree, class, 0, bits,
+		      ref_length(entries, ref_flags()));
+	for (size_t i = 0; i < length; i++)
+		tree->ref[i] = TREE_NONE;
+	entries = mark_shared(tree, class, bits, count);
+	debug("selected %lu shared trees\n", entries);
+
+	free(count);
+	free(bits);
 }
 
-static int cmp_pri(pqueue_pri_t next, pqueue_pri_t curr)
+// classes of shifted trees, ordered by descending amount of nodes
+struct shifted_class {
+	uint32_t nodes;
+	uint32_t tree; // representative
+	uint32_t head; // of the candidate list
+};
+
+static int compare_classes(const void *a, const void *b)
 {
-	return next < curr;
+	const struct shifted_class *x = a, *y = b;
+	if (x->nodes != y->nodes)
+		return x->nodes < y->nodes ? 1 : -1;
+	return (x->tree < y->tree) - (x->tree > y->tree);
 }
 
-static void set_pos(void *a, size_t position)
+// adds n occurrences to the subtrees of a tree that have a class
+static void count_subtrees(struct tree *tree, const uint32_t *class,
+			   uint32_t *count, uint32_t i, uint32_t n)
 {
-	(void)a;
-	(void)position;
+	if (tree->type[i] == VAR)
+		return;
+	if (class[tree->lhs[i]] != TREE_NONE)
+		add_saturated(&count[tree->lhs[i]], n);
+	if (tree->type[i] == APP && class[tree->rhs[i]] != TREE_NONE)
+		add_saturated(&count[tree->rhs[i]], n);
 }
 
-struct tree *tree_merge_duplicates(struct term *term, void **all_trees)
+// like mark_shared, but the subtrees of shifted trees aren't shifted
+// versions of each other if they contain indices bound above them, so
+// every tree is counted separately -- a class is visited after all parents
+// of its trees, as they have more nodes
+static size_t mark_shifted(struct tree *tree, struct builder *builder,
+			   const uint32_t *class, const uint32_t *entry,
+			   const struct shifted_class *classes, size_t length,
+			   const uint32_t *bits, uint32_t *count)
 {
-	debug("building the merkle tree and deduplication set\n");
+	size_t entries = 0;
+	memset(count, 0, tree->length * sizeof(*count));
+	count[tree->root] = 1;
+	for (size_t c = 0; c < length; c++) {
+		const uint32_t rep = classes[c].tree;
+		const uint32_t head = classes[c].head;
+		if (head == rep) { // single tree, can't be shared
+			count_subtrees(tree, class, count, rep, count[rep]);
+			continue;
+		}
 
-	// get the deduplication candidates
-	void *set = 0;
-	struct tree *built = build_tree(term, &set);
-	if (!set) {
-		debug("term not suitable for deduplication, emitting directly\n");
-		return built;
+		uint32_t total = 0;
+		uint64_t shifts = 0;
+		for (uint32_t i = head; i != TREE_NONE; i = builder->next[i]) {
+			const uint32_t shift =
+				tree->shift[i] - tree->shift[entry[rep]];
+			add_saturated(&total, count[i]);
+			shifts += (uint64_t)count[i] *
+				  shift_bits(shift, ref_flags());
+		}
+
+		if (rep != class[tree->root] && total > 1 &&
+		    worth_sharing(bits[entry[rep]], total, entries, shifts)) {
+			tree->ref[rep] = INVALIDATED_TREE;
+			entries++;
+			count_subtrees(tree, class, count, entry[rep], 1);
+			continue;
+		}
+
+		for (uint32_t i = head; i != TREE_NONE; i = builder->next[i])
+			count_subtrees(tree, class, count, i, count[i]);
+	}
+	return entries;
+}
+
+// like select_shared, the entry of a class is its least shifted tree, so
+// that every reference shifts it upwards
+static void select_shifted(struct tree *tree, struct builder *builder,
+			   const uint32_t *class, const uint32_t *entry,
+			   const uint32_t *head)
+{
+	const size_t length = tree->length;
+	size_t classes_length = 0;
+	for (size_t i = 0; i < length; i++)
+		classes_length += class[i] == i;
+
+	uint32_t *count = malloc(length * sizeof(*count));
+	uint32_t *bits = malloc(length * sizeof(*bits));
+	struct shifted_class *classes =
+		malloc(classes_length * sizeof(*classes));
+	if (!count || !bits || !classes)
+		fatal("out of memory!\n");
+
+	classes_length = 0;
+	for (size_t i = 0; i < length; i++)
+		if (class[i] == i)
+			classes[classes_length++] = (struct shifted_class){
+				i - builder->first[i] + 1, i, head[i]
+			};
+	qsort(classes, classes_length, sizeof(*classes), compare_classes);
+
+	estimate_bits(tree, class, entry, bits, 0);
+	size_t entries = mark_shifted(tree, builder, class, entry, classes,
+				      classes_length, bits, count);
+
+	estimate_bits(tree, class, entry, bits,
+		      ref_length(entries, ref_flags()));
+	for (size_t i = 0; i < length; i++)
+		tree->ref[i] = TREE_NONE;
+	entries = mark_shifted(tree, builder, class, entry, classes,
+			       classes_length, bits, count);
+	debug("selected %lu shared trees\n", entries);
+
+	free(count);
+	free(bits);
+	free(classes);
+}
+
+// the table entries are clones, so they don't get replaced themselves
+static uint32_t clone_tree(struct tree *tree, struct builder *builder,
+			   uint32_t i)
+{
+	const uint32_t clone = new_tree(tree, builder, tree->type[i],
+					tree->lhs[i], tree->rhs[i],
+					tree->hash[i]);
+	if (tree->shift)
+		tree->shift[clone] = tree->shift[i];
+	tree->shared++;
+	return clone;
+}
+
+static void share_dag(struct tree *tree, struct builder *builder)
+{
+	const size_t length = tree->length;
+	select_shared(tree, 0);
+	for (size_t i = 0; i < length; i++) {
+		if (tree->ref[i] != INVALIDATED_TREE)
+			continue;
+		// cloning may move the columns
+		const uint32_t clone = clone_tree(tree, builder, i);
+		tree->ref[i] = clone;
 	}
+}
+
+// pair of subtrees that are compared, under depth binders of the trees
+struct shifted_pair {
+	uint32_t a, b;
+	uint32_t depth;
+};
+
+// state of the comparisons while splitting the candidate lists
+struct comparison {
+	const uint32_t *class; // already split, for all smaller trees
+	const uint32_t *bound; // 1 + highest free index, 0 if closed
+	struct shifted_pair *stack;
+	size_t capacity;
+};
+
+// whether a pair of subtrees is already known to be equal, as they are in
+// the same class and their free indices are shifted like those of the
+// compared trees (or bound by them)
+static int known_equal(struct tree *tree, struct comparison *comparison,
+		       uint32_t a, uint32_t b, struct shifted_pair pair)
+{
+	const uint32_t *class = comparison->class;
+	if (class[pair.a] == TREE_NONE || class[pair.a] != class[pair.b])
+		return 0;
+
+	const uint32_t bound = comparison->bound[pair.a];
+	const uint32_t shift_a = tree->shift[pair.a];
+	const uint32_t shift_b = tree->shift[pair.b];
+	if (!bound)
+		return 1;
+	if (bound <= pair.depth)
+		return shift_a == shift_b;
+	return shift_a >= pair.depth &&
+	       (uint64_t)shift_a + tree->shift[b] ==
+		       (uint64_t)shift_b + tree->shift[a];
+}
+
+// whether tree b equals tree a up to a shift of their free indices
+static int equal_shifted(struct tree *tree, struct builder *builder,
+			 struct comparison *comparison, uint32_t a, uint32_t b)
+{
+	if (a - builder->first[a] != b - builder->first[b])
+		return 0;
+
+	size_t depth = 0;
+	struct shifted_pair *stack = comparison->stack;
+	stack[depth++] = (struct shifted_pair){ a, b, 0 };
+	while (depth) {
+		const struct shifted_pair pair = stack[--depth];
+		const uint32_t x = pair.a, y = pair.b;
+		if (tree->type[x] != tree->type[y])
+			return 0;
+		if (x != a && known_equal(tree, comparison, a, b, pair))
+			continue;
+
+		if (depth + 2 > comparison->capacity) {
+			comparison->capacity *= 2;
+			stack = realloc(stack, comparison->capacity *
+						       sizeof(*stack));
+			if (!stack)
+				fatal("out of memory!\n");
+			comparison->stack = stack;
+		}
 
-	// construct priority queue while deleting set
-	// ~> sorts the candidates by get_pri
-	debug("constructing priority queue\n");
-	struct pqueue *prioritized =
-		pqueue_init(2 << 15, cmp_pri, get_pri, set_pos);
-	if (!prioritized)
-		fatal("can't create pqueue\n");
-	while (set) {
-		struct hash_to_list *element = *(struct hash_to_list **)set;
-		pqueue_insert(prioritized, element->list);
-		tdelete(element, &set, hash_compare);
-		free(element);
+		switch (tree->type[x]) {
+		case ABS:
+			stack[depth++] = (struct shifted_pair){
+				tree->lhs[x], tree->lhs[y], pair.depth + 1
+			};
+			break;
+		case APP:
+			stack[depth++] = (struct shifted_pair){
+				tree->rhs[x], tree->rhs[y], pair.depth
+			};
+			stack[depth++] = (struct shifted_pair){
+				tree->lhs[x], tree->lhs[y], pair.depth
+			};
+			break;
+		case VAR:;
+			// bound indices are equal, free ones are shifted
+			const uint64_t i = tree->lhs[x], j = tree->lhs[y];
+			if (i < pair.depth || j < pair.depth) {
+				if (i != j)
+					return 0;
+			} else if (i + tree->shift[b] != j + tree->shift[a]) {
+				return 0;
+			}
+			break;
+		default:
+			fatal("invalid type %d\n", tree->type[x]);
+		}
 	}
+	return 1;
+}
+
+// the shifted hashes of different trees may collide, so the candidate
+// lists are split into classes of trees that are actually equal up to the
+// shift, every class is linked using next from the head it returns
+static uint32_t *split_shifted(struct tree *tree, struct builder *builder,
+			       uint32_t *class)
+{
+	const size_t length = tree->length;
+	uint32_t *head = malloc(length * sizeof(*head));
+	uint32_t *other = malloc(length * sizeof(*other)); // same hash
+	uint32_t *bound = malloc(length * sizeof(*bound));
+	if (!head || !other || !bound)
+		fatal("out of memory!\n");
 
-	struct list *invalidated = list_end;
+	for (size_t i = 0; i < length; i++) {
+		switch (tree->type[i]) {
+		case ABS:
+			bound[i] = bound[tree->lhs[i]] ?
+					   bound[tree->lhs[i]] - 1 :
+					   0;
+			break;
+		case APP:
+			bound[i] = bound[tree->lhs[i]] > bound[tree->rhs[i]] ?
+					   bound[tree->lhs[i]] :
+					   bound[tree->rhs[i]];
+			break;
+		default:
+			bound[i] = tree->lhs[i] + 1;
+		}
+	}
 
-	// add longest (=> blueprint/structure of expression)
-	struct list *longest = pqueue_pop(prioritized);
-	struct hash_to_tree *element = malloc(sizeof(*element));
-	element->hash = ((struct tree *)longest->data)->hash;
-	element->tree = longest->data;
-	tsearch(element, all_trees, hash_compare);
+	struct comparison comparison = {
+		.class = class,
+		.bound = bound,
+		.capacity = 64,
+	};
+	comparison.stack =
+		malloc(comparison.capacity * sizeof(*comparison.stack));
+	if (!comparison.stack)
+		fatal("out of memory!\n");
 
-	debug("iterating priority queue, invalidating duplicates\n");
-	struct list *iterator;
-	while ((iterator = pqueue_pop(prioritized))) {
-		// only consider merging if they occur >1 times
-		if (iterator->val <= 1)
+	// the earliest tree of every list is the first class, the others
+	// are compared in order, so their subtrees are already split
+	for (size_t i = 0; i < length; i++) {
+		if (class[i] == TREE_NONE)
 			continue;
+		uint32_t rep = class[i], last = TREE_NONE;
+		while (rep != i && rep != TREE_NONE &&
+		       !equal_shifted(tree, builder, &comparison, rep, i)) {
+			last = rep;
+			rep = other[rep];
+		}
+		if (rep == TREE_NONE || rep == i) {
+			rep = i;
+			head[i] = TREE_NONE;
+			other[i] = TREE_NONE;
+			if (last != TREE_NONE)
+				other[last] = i;
+		}
+		class[i] = rep;
+		builder->next[i] = head[rep];
+		head[rep] = i;
+	}
 
-		struct tree *head = iterator->data;
+	free(comparison.stack);
+	free(other);
+	free(bound);
+	return head;
+}
 
-		// skip if invalidated and not duplicated enough
-		if (head->state != VALIDATED_TREE &&
-		    head->duplication_count >= iterator->val)
+// every candidate list is a class, all of its trees get replaced
+// the representative is always the earliest tree of the class, the entry
+// is a clone of it or of the least shifted tree if sharing shifted trees
+static void share_candidates(struct tree *tree, struct builder *builder)
+{
+	const size_t length = tree->length;
+	uint32_t *class = calloc(length, sizeof(*class));
+	if (!class)
+		fatal("out of memory!\n");
+	for (size_t i = 0; i < length; i++) {
+		class[i] = TREE_NONE;
+		if (tree->size[i] < min_size)
 			continue;
+		const struct hash_to_list *element =
+			map_find(&builder->set, tree->hash[i]);
+		class[i] = element->tail;
+	}
 
-		// clone root so it doesn't get replaced by a ref to itself
-		struct tree *cloned_head = clone_tree_root(head);
-		cloned_head->state = INVALIDATED_TREE;
-
-		element = malloc(sizeof(*element));
-		element->hash = cloned_head->hash;
-		element->tree = cloned_head;
-		struct hash_to_tree **handle =
-			tsearch(element, all_trees, hash_compare);
-		if (*handle != element)
-			free(element); // already exists, not needed
-
-		// invalidate all subtrees
-		// invalidated trees will be replaced with a reference
-		struct list *list = iterator;
-		while (list) {
-			invalidate_tree(list->data, list->val);
-
-			// keep a ref for later replacement
-			((struct tree *)list->data)->state = head->hash;
-
-			invalidated = list_add(invalidated, list->data);
-			list = list->next;
+	uint32_t *entry = 0;
+	if (shift_sharing) {
+		uint32_t *head = split_shifted(tree, builder, class);
+		entry = malloc(length * sizeof(*entry));
+		if (!entry)
+			fatal("out of memory!\n");
+		for (size_t i = 0; i < length; i++)
+			if (class[i] == i ||
+			    (class[i] != TREE_NONE &&
+			     tree->shift[i] < tree->shift[entry[class[i]]]))
+				entry[class[i]] = i;
+		select_shifted(tree, builder, class, entry, head);
+		free(head);
+	} else {
+		select_shared(tree, class);
+	}
+
+	for (size_t i = 0; i < length; i++) {
+		if (class[i] == TREE_NONE)
+			continue;
+		if (class[i] != i) {
+			tree->ref[i] = tree->ref[class[i]];
+		} else if (tree->ref[i] == INVALIDATED_TREE) {
+			// cloning may move the columns
+			const uint32_t clone = clone_tree(
+				tree, builder, entry ? entry[i] : i);
+			tree->ref[i] = clone;
 		}
 	}
+	free(class);
+	free(entry);
+}
 
-	// destroy invalidated list and replace reffed subtrees
-	debug("replacing invalidated trees with references\n");
-	iterator = invalidated;
-	while (iterator) {
-		ref_invalidated_tree(iterator->data);
-		struct list *temp = iterator->next;
-		free(iterator);
-		iterator = temp;
+// the trees are already hashed while building if sharing shifted trees
+static void collect_candidates(struct tree *tree, struct builder *builder)
+{
+	map_init(&builder->set, sizeof(struct hash_to_list), 0);
+	for (size_t i = 0; i < tree->length; i++)
+		add_candidate(tree, builder->next, &builder->set, i);
+}
+
+static void free_builder(struct builder *builder)
+{
+	free(builder->next);
+	free(builder->first);
+	free(builder->levels);
+	free(builder->merged);
+	map_destroy(&builder->set);
+}
+
+struct tree *tree_merge_duplicates(struct blc_stream *stream)
+{
+	debug("building the merkle tree and deduplication set\n");
+
+	struct tree *tree = calloc(1, sizeof(*tree));
+	if (!tree)
+		fatal("out of memory!\n");
+	struct builder builder = { 0 };
+	if (hash_consing)
+		map_init(&builder.set, sizeof(uint32_t), 0);
+
+	// get the deduplication candidates
+	build_tree(stream, tree, &builder);
+	debug("built %lu trees\n", tree->length);
+	if (hash_consing) {
+		share_dag(tree, &builder);
+		free_builder(&builder);
+		return tree;
 	}
+	if (shift_sharing)
+		collect_candidates(tree, &builder);
+	else
+		hash_trees(tree, &builder);
+	if (!builder.set.length) {
+		debug("term not suitable for deduplication, emitting directly\n");
+		free_builder(&builder);
+		return tree;
+	}
+
+	debug("selecting shared trees\n");
+	share_candidates(tree, &builder);
+	free_builder(&builder);
+
+	return tree;
+}
 
-	// destroy prioritized list
-	pqueue_free(prioritized);
+void walk_stack_init(struct walk_stack *stack)
+{
+	stack->capacity = 64;
+	stack->frames = malloc(stack->capacity * sizeof(*stack->frames));
+	if (!stack->frames)
+		fatal("out of memory!\n");
+}
 
-	return longest->data;
+void walk_stack_destroy(struct walk_stack *stack)
+{
+	free(stack->frames);
 }
 
-void tree_destroy(struct list *table)
+// depth-first traversal with an explicit stack, lhs before rhs
+// deep terms (e.g. church numerals) would overflow the call stack otherwise
+void tree_walk(struct tree *tree, uint32_t root, tree_pre_f pre,
+	       tree_post_f post, void *data, struct walk_stack *stack)
 {
-	return;
-	debug("freeing %d tree elements\n", table->val);
-	struct list *iterator = table;
-	while (iterator) {
-		free_tree(iterator->data, 0);
-		struct list *temp = iterator->next;
-		free(iterator);
-		iterator = temp;
+	size_t depth = 0;
+	struct walk_frame *frames = stack->frames;
+	frames[depth++] = (struct walk_frame){ root, 0 };
+	while (depth) {
+		const struct walk_frame frame = frames[--depth];
+		const uint32_t i = frame.tree;
+		if (frame.post) {
+			post(tree, i, data);
+			continue;
+		}
+		if (pre && !pre(tree, i, data))
+			continue;
+
+		// at most three new frames
+		if (depth + 3 > stack->capacity) {
+			stack->capacity *= 2;
+			frames = realloc(frames,
+					 stack->capacity * sizeof(*frames));
+			if (!frames)
+				fatal("out of memory!\n");
+			stack->frames = frames;
+		}
+		if (post)
+			frames[depth++] = (struct walk_frame){ i, 1 };
+		if (tree->type[i] == APP) {
+			frames[depth++] =
+				(struct walk_frame){ tree->rhs[i], 0 };
+			frames[depth++] =
+				(struct walk_frame){ tree->lhs[i], 0 };
+		} else if (tree->type[i] == ABS) {
+			frames[depth++] =
+				(struct walk_frame){ tree->lhs[i], 0 };
+		}
 	}
 }
+
+void tree_destroy(struct tree *tree)
+{
+	debug("freeing %lu trees\n", tree->length);
+	free(tree->type);
+	free(tree->lhs);
+	free(tree->rhs);
+	free(tree->hash);
+	free(tree->size);
+	free(tree->ref);
+	free(tree->shift);
+	free(tree);
+}